@@ -0,0 +1,207 @@
+import argparse
+import math
+import numpy as np
+import torch
+from transformers import AutoTokenizer, AutoModelForSequenceClassification
+from datasets import load_dataset
+
+# Калибровка интервалов активаций: прогоняет plaintext-модель по калибровочному набору, записывает
+# реальные диапазоны на входе каждой аппроксимируемой функции и пишет конфиг (--calibration у
+# encrypt_weights, client_inference_batch и benchmark_eval) с узкими интервалами, масштабами и
+# минимальной степенью полинома Чебышёва для заданной ошибки.
+#
+# Узкий интервал -> меньше степень -> меньше уровней при той же точности.
+# Масштабы вшиваются в веса (encrypt_weights): client_inference_batch должен получить тот же файл,
+# с которым шифровались веса.
+
+MODEL_NAME = "philschmid/tiny-bert-sst2-distilled"
+LOGIT_SCALE = 100  # accumulate_logits / benchmark_eval: знак считается от 100 * (neg - pos)
+MAX_DEGREE = 2031  # последняя степень в chebyshev_depth (Utils.h)
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Offline range calibration of the FHE activations")
+    parser.add_argument("--output", default="calibration.cfg")
+    parser.add_argument("--samples", type=int, default=512, help="sentences of the calibration set")
+    parser.add_argument("--split", default="train", help="glue/sst2 split (validation = the benchmark set)")
+    parser.add_argument("--batch-size", type=int, default=32)
+    parser.add_argument("--margin", type=float, default=0.1,
+                        help="relative headroom over the observed maximum |x|")
+    parser.add_argument("--target-error", type=float, default=1e-3,
+                        help="max error of the tanh / GELU polynomials on the whole interval")
+    parser.add_argument("--sign-error", type=float, default=0.1,
+                        help="max |p(x) - sign(x)| on the calibration logit differences")
+    parser.add_argument("--sign-quantile", type=float, default=0.01,
+                        help="fraction of the smallest |differences| the sign degree may ignore")
+    return parser.parse_args()
+
+
+def wrap_sentence(x: np.ndarray) -> np.ndarray:
+    return np.char.add("[CLS] ", np.char.add(x, " [SEP]"))
+
+
+# То же, что EvalChebyshevFunction / utils::chebyshev_coefficients: узлы Чебышёва, c0/2
+def chebyshev_error(f, a, b, degree, points):
+    n = degree + 1
+    k = np.arange(n)
+    nodes = (b - a) / 2 * np.cos(np.pi * (k + 0.5) / n) + (a + b) / 2
+    values = f(nodes)
+    coefficients = 2.0 / n * np.cos(np.pi * np.outer(np.arange(n), k + 0.5) / n) @ values
+    coefficients[0] /= 2
+
+    t = (2 * points - a - b) / (b - a)
+    return np.abs(np.polynomial.chebyshev.chebval(t, coefficients) - f(points))
+
+
+def chebyshev_depth(degree):
+    depth = 4
+    for limit in (5, 13, 27, 59, 119, 247, 495, 1007, 2031):
+        if degree <= limit:
+            return depth
+        depth += 1
+    return depth
+
+
+# Минимальная степень с ошибкой <= target. Сначала граница глубины (5, 13, 27, ...), на которой ошибка
+# впервые проходит, затем линейно внутри неё: ошибка по степени не строго монотонна
+def minimal_degree(f, a, b, target, points):
+    lower = 3
+    for limit in (5, 13, 27, 59, 119, 247, 495, 1007, MAX_DEGREE):
+        if chebyshev_error(f, a, b, limit, points).max() <= target:
+            break
+        lower = limit + 1
+
+    for degree in range(lower, MAX_DEGREE + 1):
+        error = chebyshev_error(f, a, b, degree, points).max()
+        if error <= target:
+            return degree, error
+    return MAX_DEGREE, error
+
+
+def gelu(x):
+    return 0.5 * x * (1 + np.vectorize(math.erf)(x / math.sqrt(2)))
+
+
+def collect_ranges(args):
+    dataset = load_dataset("glue", "sst2", split=args.split)
+    texts = np.array(dataset["sentence"][:args.samples]).astype(str)
+
+    tokenizer = AutoTokenizer.from_pretrained(MODEL_NAME)
+    model = AutoModelForSequenceClassification.from_pretrained(MODEL_NAME)
+    model.eval()
+
+    # Входы аппроксимируемых функций: dense перед GELU (оба слоя encoder) и dense перед tanh (pooler)
+    ranges = {}
+
+    def record(name):
+        def hook(module, inputs, output):
+            values = output.detach().abs().max().item()
+            ranges[name] = max(ranges.get(name, 0.0), values)
+        return hook
+
+    # Без масштаба в весах, только интервал: сумма exp(scores) строки softmax и дисперсия 128 признаков
+    # перед обоими LayerNorm слоя (client_inference_batch --encoder / --exact-layernorm)
+    intervals = {}
+
+    def extend(name, values):
+        low, high = intervals.get(name, (math.inf, 0.0))
+        intervals[name] = (min(low, values.min().item()), max(high, values.max().item()))
+
+    def softmax_sums(name):
+        def hook(module, inputs):
+            h = inputs[0]
+            shape = (*h.shape[:2], module.num_attention_heads, module.attention_head_size)
+            q = module.query(h).view(shape).transpose(1, 2)
+            k = module.key(h).view(shape).transpose(1, 2)
+            scores = q @ k.transpose(-1, -2) / math.sqrt(module.attention_head_size)
+            extend(name, scores.exp().sum(dim=-1))
+        return hook
+
+    def variance(name):
+        def hook(module, inputs):
+            extend(name, inputs[0].var(dim=-1, unbiased=False))
+        return hook
+
+    layers = model.bert.encoder.layer
+    for i, layer in enumerate(layers):
+        layer.intermediate.dense.register_forward_hook(record(f"layer{i}.gelu"))
+        layer.attention.self.register_forward_pre_hook(softmax_sums(f"layer{i}.softmax_sum"))
+        layer.attention.output.LayerNorm.register_forward_pre_hook(variance(f"layer{i}.layernorm_var"))
+        layer.output.LayerNorm.register_forward_pre_hook(variance(f"layer{i}.layernorm_var"))
+    model.bert.pooler.dense.register_forward_hook(record("pooler.tanh"))
+
+    differences = []
+    for first in range(0, len(texts), args.batch_size):
+        batch = wrap_sentence(texts[first:first + args.batch_size])
+        inputs = tokenizer(list(batch), return_tensors="pt", padding=True, truncation=True)
+        tokens = inputs["input_ids"]
+
+        # Как TinyBertPartial в inference_batch.py: token_type_ids = 1, без attention mask
+        with torch.no_grad():
+            x = model.bert.embeddings(tokens, torch.ones_like(tokens))
+            for layer in layers:
+                x = layer(x)[0]
+            logits = model.classifier(model.bert.pooler(x))
+
+        differences.extend((LOGIT_SCALE * (logits[:, 0] - logits[:, 1])).tolist())
+
+    return ranges, intervals, np.abs(np.array(differences)), len(texts)
+
+
+def main():
+    args = parse_args()
+    ranges, intervals, differences, count = collect_ranges(args)
+    grid = np.linspace(-1, 1, 4001)
+
+    lines = [f"# calibrate.py: {count} sentences of glue/sst2 {args.split}, margin {args.margin}, "
+             f"target error {args.target_error}"]
+
+    def activation(name, key, f):
+        bound = ranges[name] * (1 + args.margin)
+        # Вход масштабируется в [-1, 1] весами: полином приближает f(x / scale) на [-1, 1]
+        degree, error = minimal_degree(lambda x: f(x * bound), -1, 1, args.target_error, grid)
+        lines.append(f"# {name}: max |x| = {ranges[name]:.4f}, error {error:.2e}, depth {chebyshev_depth(degree)}")
+        lines.append(f"{key}_scale = 1/{bound:.6g}")
+        lines.append(f"{key}_degree = {degree}")
+        print(f"{name}: |x| <= {ranges[name]:.4f}, scale 1/{bound:.6g}, degree {degree} "
+              f"(depth {chebyshev_depth(degree)}), error {error:.2e}")
+
+    # Интервал с запасом в обе стороны: [min / (1 + margin), max * (1 + margin)]
+    def interval(name):
+        low, high = intervals[name]
+        lines.append(f"# {name}: [{low:.4f}, {high:.4f}]")
+        lines.append(f"{name}_min = {low / (1 + args.margin):.6g}")
+        lines.append(f"{name}_max = {high * (1 + args.margin):.6g}")
+        print(f"{name}: [{low:.4f}, {high:.4f}], interval [{low / (1 + args.margin):.6g}, "
+              f"{high * (1 + args.margin):.6g}]")
+
+    for i in range(2):
+        activation(f"layer{i}.gelu", f"layer{i}.gelu", gelu)
+        interval(f"layer{i}.softmax_sum")
+        interval(f"layer{i}.layernorm_var")
+    activation("pooler.tanh", "pooler.tanh", np.tanh)
+
+    # Знак: разрыв в нуле, ошибка считается только на разностях логитов калибровочного набора
+    bound = differences.max() * (1 + args.margin)
+    smallest = np.quantile(differences, args.sign_quantile)
+    points = np.concatenate([differences[differences >= smallest], -differences[differences >= smallest]])
+    degree, error = minimal_degree(np.sign, -bound, bound, args.sign_error, points)
+
+    lines.append(f"# eval.sign: max |100 * (neg - pos)| = {differences.max():.4f}, "
+                 f"{args.sign_quantile:.0%} below {smallest:.4f} ignored, error {error:.2e}, "
+                 f"depth {chebyshev_depth(degree)}")
+    lines.append(f"eval.sign_bound = {bound:.6g}")
+    lines.append(f"eval.sign_degree = {degree}")
+    print(f"eval.sign: |x| <= {differences.max():.4f}, interval [-{bound:.6g}, {bound:.6g}], degree {degree} "
+          f"(depth {chebyshev_depth(degree)}), error {error:.2e}")
+    if error > args.sign_error:
+        print(f"[WARNING] sign error {error:.2e} over {args.sign_error} at degree {MAX_DEGREE}, "
+              f"raise --sign-quantile")
+
+    with open(args.output, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    print(f"[INFO] Calibration saved to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
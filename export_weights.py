@@ -0,0 +1,219 @@
+import argparse
+import math
+import os
+import numpy as np
+import torch
+from transformers import AutoTokenizer, AutoModelForSequenceClassification
+from datasets import load_dataset
+
+# Экспорт весов encoder (layer0_*, layer1_*) в weights-sst2/ для encrypt_weights --encoder.
+# Файлы без масштабов: encrypt_weights сам умножает на gelu_scale (--calibration) и знак mean.
+#
+# Ориентация — та, которую читают matmul* в FHEController (read_plain_input: файл построчно, слот 128r + c):
+#   attself_{query,key,value}_weight  W^T (строка = входной признак), matmulRE
+#   selfoutput_weight                 W   (строка = выходной признак), matmulCR
+#   intermediate_weight{1..4}         W^T[:, 128(k-1):128k],           matmulRElarge
+#   output_weight{1..4}               W[:, 128(k-1):128k],             matmulCRlarge
+# LayerNorm с предпосчитанной статистикой (без --exact-layernorm), в wrapped-раскладке (признак j токена i
+# в слоте 128j + i) статистика зависит от позиции токена:
+#   <prefix>_mean   среднее по признакам на позиции i (128 значений, знак минус добавляет encrypt_weights)
+#   <prefix>_vy     строка j, столбец i: gamma_j / sqrt(var_i + eps)
+#   <prefix>_normweight / _normbias   gamma / beta
+#
+# --verify N: encoder по экспортированным файлам (та же математика, что client_inference_batch --encoder,
+# в открытом виде) против TinyBertPartial из inference_batch.py на N предложениях validation
+
+MODEL_NAME = "philschmid/tiny-bert-sst2-distilled"
+WEIGHTS_FOLDER = "weights-sst2"
+MAX_TOKENS = 64   # лимит client_inference_batch --encoder
+POSITIONS = 128   # wrapped-раскладка: 128 позиций токена
+HEADS = 2
+HEAD_SIZE = 64
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Export of the TinyBERT encoder weights for encrypt_weights --encoder")
+    parser.add_argument("--output", default=WEIGHTS_FOLDER)
+    parser.add_argument("--samples", type=int, default=512, help="glue/sst2 train sentences for the LayerNorm statistics")
+    parser.add_argument("--verify", type=int, default=0, metavar="N",
+                        help="compare the exported layers with TinyBertPartial on N validation sentences")
+    return parser.parse_args()
+
+
+def wrap_sentence(x):
+    return "[CLS] " + x + " [SEP]"
+
+
+# Без padding и без attention mask: client_inference_batch считает каждый пример отдельно
+def tokenize(tokenizer, text):
+    return tokenizer(wrap_sentence(text), return_tensors="pt", truncation=True, max_length=MAX_TOKENS)["input_ids"]
+
+
+def save(folder, name, values):
+    np.savetxt(f"{folder}/{name}.txt", values, delimiter=",")
+
+
+# Среднее и дисперсия по признакам на каждой позиции токена, на входе обоих LayerNorm каждого слоя
+def layernorm_statistics(model, tokenizer, samples):
+    texts = load_dataset("glue", "sst2", split="train")["sentence"][:samples]
+    layers = model.bert.encoder.layer
+
+    sums = {}
+
+    def record(name):
+        def hook(module, inputs):
+            x = inputs[0][0].detach().double().numpy()
+            n = x.shape[0]
+            s = sums.setdefault(name, [np.zeros(POSITIONS), np.zeros(POSITIONS), np.zeros(POSITIONS)])
+            s[0][:n] += x.mean(axis=1)
+            s[1][:n] += x.var(axis=1)
+            s[2][:n] += 1
+        return hook
+
+    handles = []
+    for i, layer in enumerate(layers[:2]):
+        handles.append(layer.attention.output.LayerNorm.register_forward_pre_hook(record(f"layer{i}_selfoutput")))
+        handles.append(layer.output.LayerNorm.register_forward_pre_hook(record(f"layer{i}_output")))
+
+    with torch.no_grad():
+        for text in texts:
+            tokens = tokenize(tokenizer, text)
+            x = model.bert.embeddings(tokens, torch.ones_like(tokens))
+            for layer in layers[:2]:
+                x = layer(x)[0]
+
+    for handle in handles:
+        handle.remove()
+
+    statistics = {}
+    for name, (mean_sum, var_sum, count) in sums.items():
+        # Позиции, которых нет в калибровочном наборе, получают статистику по всем токенам
+        seen = count > 0
+        mean = np.full(POSITIONS, mean_sum[seen].sum() / count[seen].sum())
+        var = np.full(POSITIONS, var_sum[seen].sum() / count[seen].sum())
+        mean[seen] = mean_sum[seen] / count[seen]
+        var[seen] = var_sum[seen] / count[seen]
+        statistics[name] = (mean, var)
+
+    return statistics
+
+
+def export(model, statistics, folder):
+    os.makedirs(folder, exist_ok=True)
+    eps = model.config.layer_norm_eps
+
+    for i, layer in enumerate(model.bert.encoder.layer[:2]):
+        prefix = f"layer{i}_"
+        attention = layer.attention
+
+        for name, dense in (("query", attention.self.query), ("key", attention.self.key), ("value", attention.self.value)):
+            save(folder, f"{prefix}attself_{name}_weight", dense.weight.detach().numpy().T)
+            save(folder, f"{prefix}attself_{name}_bias", dense.bias.detach().numpy())
+
+        save(folder, f"{prefix}selfoutput_weight", attention.output.dense.weight.detach().numpy())
+        save(folder, f"{prefix}selfoutput_bias", attention.output.dense.bias.detach().numpy())
+
+        intermediate = layer.intermediate.dense.weight.detach().numpy().T  # 128 x 512
+        output = layer.output.dense.weight.detach().numpy()                # 128 x 512
+        for k in range(4):
+            save(folder, f"{prefix}intermediate_weight{k + 1}", intermediate[:, 128 * k:128 * (k + 1)])
+            save(folder, f"{prefix}output_weight{k + 1}", output[:, 128 * k:128 * (k + 1)])
+        save(folder, f"{prefix}intermediate_bias", layer.intermediate.dense.bias.detach().numpy())
+        save(folder, f"{prefix}output_bias", layer.output.dense.bias.detach().numpy())
+
+        for name, norm in (("selfoutput", attention.output.LayerNorm), ("output", layer.output.LayerNorm)):
+            gamma = norm.weight.detach().double().numpy()
+            mean, var = statistics[prefix + name]
+            save(folder, f"{prefix}{name}_mean", mean)
+            save(folder, f"{prefix}{name}_vy", np.outer(gamma, 1 / np.sqrt(var + eps)))
+            save(folder, f"{prefix}{name}_normweight", gamma)
+            save(folder, f"{prefix}{name}_normbias", norm.bias.detach().numpy())
+
+    print(f"[INFO] Encoder weights saved to {folder}/layer0_* and {folder}/layer1_*")
+
+
+def load(folder, name):
+    return np.loadtxt(f"{folder}/{name}.txt", delimiter=",")
+
+
+def gelu(x):
+    return 0.5 * x * (1 + np.vectorize(math.erf)(x / math.sqrt(2)))
+
+
+def softmax(x):
+    e = np.exp(x - x.max(axis=-1, keepdims=True))
+    return e / e.sum(axis=-1, keepdims=True)
+
+
+# Один слой в открытом виде по файлам, как encoder_layer в client_inference_batch (x: токены x 128)
+def layer_from_files(x, folder, prefix, exact_layernorm, eps):
+    def layernorm(r, name):
+        beta = load(folder, f"{prefix}{name}_normbias")
+        if exact_layernorm:
+            gamma = load(folder, f"{prefix}{name}_normweight")
+            return (r - r.mean(axis=1, keepdims=True)) / np.sqrt(r.var(axis=1, keepdims=True) + eps) * gamma + beta
+        n = r.shape[0]
+        mean = load(folder, f"{prefix}{name}_mean")[:n]
+        vy = load(folder, f"{prefix}{name}_vy")[:, :n]
+        return (r - mean[:, None]) * vy.T + beta
+
+    q, k, v = (x @ load(folder, f"{prefix}attself_{name}_weight") + load(folder, f"{prefix}attself_{name}_bias")
+               for name in ("query", "key", "value"))
+
+    context = np.zeros_like(q)
+    for h in range(HEADS):
+        heads = slice(HEAD_SIZE * h, HEAD_SIZE * (h + 1))
+        scores = q[:, heads] @ k[:, heads].T / math.sqrt(HEAD_SIZE)
+        context[:, heads] = softmax(scores) @ v[:, heads]
+
+    attention = context @ load(folder, f"{prefix}selfoutput_weight").T + load(folder, f"{prefix}selfoutput_bias")
+    y = layernorm(attention + x, "selfoutput")
+
+    hidden = np.concatenate([y @ load(folder, f"{prefix}intermediate_weight{j}") for j in range(1, 5)], axis=1)
+    hidden = gelu(hidden + load(folder, f"{prefix}intermediate_bias"))
+
+    output = sum(hidden[:, 128 * (j - 1):128 * j] @ load(folder, f"{prefix}output_weight{j}").T for j in range(1, 5))
+    return layernorm(output + load(folder, f"{prefix}output_bias") + y, "output")
+
+
+def verify(model, tokenizer, folder, count):
+    texts = load_dataset("glue", "sst2", split="validation")["sentence"][:count]
+    eps = model.config.layer_norm_eps
+    errors = {False: [], True: []}
+
+    for text in texts:
+        tokens = tokenize(tokenizer, text)
+        with torch.no_grad():
+            x = model.bert.embeddings(tokens, torch.ones_like(tokens))
+            embeddings = x[0].double().numpy()
+            for layer in model.bert.encoder.layer[:2]:
+                x = layer(x)[0]
+        reference = x[0, 0].double().numpy()
+
+        for exact in errors:
+            hidden = embeddings
+            for i in range(2):
+                hidden = layer_from_files(hidden, folder, f"layer{i}_", exact, eps)
+            errors[exact].append(np.abs(hidden[0] - reference).max())
+
+    print(f"[INFO] Encoder [CLS] from {folder} vs TinyBertPartial, {count} validation sentences:")
+    print(f"  --exact-layernorm:        max |diff| = {max(errors[True]):.2e}")
+    print(f"  precomputed LayerNorm:    max |diff| = {max(errors[False]):.2e}, mean {np.mean(errors[False]):.2e}")
+
+
+def main():
+    args = parse_args()
+    tokenizer = AutoTokenizer.from_pretrained(MODEL_NAME)
+    model = AutoModelForSequenceClassification.from_pretrained(MODEL_NAME)
+    model.eval()
+
+    if args.verify > 0:
+        verify(model, tokenizer, args.output, args.verify)
+        return
+
+    statistics = layernorm_statistics(model, tokenizer, args.samples)
+    export(model, statistics, args.output)
+
+
+if __name__ == "__main__":
+    main()
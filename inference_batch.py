@@ -6,6 +6,9 @@ from transformers import AutoTokenizer, AutoModelForSequenceClassification
 from datasets import load_dataset
 import subprocess
 import os
+import sys
+import struct
+import threading
 import numpy as np
 
 # --- Конфиг ---
@@ -38,6 +41,42 @@ SET_VERBOSE = True
 if SET_VERBOSE:
     VERBOSE = "--verbose"
 
+# Модуль fhe_bert (cmake -DBUILD_PYTHON_BINDINGS=ON): ключи грузятся один раз,
+# hidden states передаются из NumPy без hs/*.txt и без запуска client_inference_batch
+sys.path.insert(0, BINARY_DIR)
+try:
+    import fhe_bert
+except ImportError:
+    fhe_bert = None
+USE_BINDINGS = fhe_bert is not None
+session = None
+
+# client_inference_batch --stream: записи идут через stdin, результаты читаются из stdout,
+# hs/*.txt не создаются (используется, если модуль fhe_bert не собран)
+STREAM_INPUT = False
+
+# client_inference_batch --evaluate: логиты сразу копятся в слотах, accuracy считается в том же
+# процессе — без results/res_i.txt.enc и без отдельного запуска benchmark_eval.
+# Каждый батч пишет свой результат (+ .partial), в конце они объединяются merge_benchmarks
+END_TO_END = False
+evaluated_partials = []
+
+
+# Батч с первого примера first: hs_<i> и res_<i> с глобальными индексами, --range выбирает батч,
+# метки --evaluate берутся с индекса first
+def batch_args(first, count):
+    args = ["--range", str(first), str(count)]
+    if END_TO_END:
+        result_name = f"benchmark_result_{first}.enc"
+        args += ["--evaluate", LABELS_FILE, result_name]
+        evaluated_partials.append(result_name + ".partial")
+    return args
+
+# Первые два слоя encoder тоже считаются в FHE (client_inference_batch --encoder),
+# на диск пишутся только эмбеддинги токенов: hs/hs_<i>/input_<token>.txt
+ENCRYPTED_ENCODER = False
+MAX_TOKENS = 64  # лимит client_inference_batch --encoder
+
 # --- Выбираем устройство ---
 device = torch.device("cuda" if torch.cuda.is_available() else "cpu")
 # device = torch.device("cpu")
@@ -87,12 +126,18 @@ def wrap_sentence(x: np.ndarray) -> np.ndarray:
     return np.char.add("[CLS] ", np.char.add(x, " [SEP]"))
 
 # --- Функция для инференса батчей ---
-def inference_batch(batch_texts):
+def inference_batch(batch_texts, first=0):
     global test_count
 
     # batch_texts = map(wrap_sentence, batch_texts)
     batch_texts = wrap_sentence(batch_texts)
-    inputs = tokenizer(list(batch_texts), return_tensors="pt", padding=True, truncation=True)
+    inputs = tokenizer(list(batch_texts), return_tensors="pt", padding=True, truncation=True,
+                       max_length=MAX_TOKENS if ENCRYPTED_ENCODER else None)
+
+    if ENCRYPTED_ENCODER:
+        dump_embeddings(inputs, first)
+        run_binary(["--encoder", *batch_args(first, len(batch_texts))])
+        return
 
     tokens_tensor = inputs["input_ids"]
     len_tokenized_text = tokens_tensor.shape[1]
@@ -105,7 +150,15 @@ def inference_batch(batch_texts):
         else:
             hidden_states = hidden_states.cpu()
 
-        for i, hs in enumerate(hidden_states):
+        if USE_BINDINGS:
+            run_session(hidden_states[:, 0, :].numpy())
+            return
+
+        if STREAM_INPUT:
+            run_stream(hs[0, :].numpy() for hs in hidden_states)
+            return
+
+        for i, hs in enumerate(hidden_states, start=first):
             print(f"Iter: {i} | Input Text: {texts[i]}")
             file_name = f"{HS_FILE}_{i}.txt"
             np.savetxt(file_name, hs.detach().cpu().numpy()[0, :], delimiter=",")
@@ -113,17 +166,95 @@ def inference_batch(batch_texts):
             print(f"[INFO] Output saved to {file_name}")
 
             # OUTPUT_FILE = f"{OUTPUT_DIR}/res_{test_count}.txt.enc"
-        # --- Запускаем бинарь с аргументом ---
-        if os.path.exists(BINARY_DIR):
-            subprocess.run([BINARY_DIR + "/client_inference_batch",
-                            HS_FOLDER,
-                            OUTPUT_DIR,
-                            VERBOSE
-                            ]
-            )
-            test_count += 1
-        else:
-            print(f"[WARNING] Binary not found at {BINARY_DIR}")
+        run_binary(batch_args(first, len(batch_texts)))
+
+# --- Эмбеддинги токенов для encoder в FHE, по файлу на токен (без padding) ---
+def dump_embeddings(inputs, first=0):
+    tokens_tensor = inputs["input_ids"]
+    with torch.no_grad():
+        # token_type_ids = 1, как в TinyBertPartial.forward
+        embeddings = partial_model.embeddings(tokens_tensor.to(device), torch.ones_like(tokens_tensor).to(device)).cpu()
+
+    for i, emb in enumerate(embeddings):
+        sample_folder = f"{HS_FILE}_{first + i}"
+        os.makedirs(sample_folder, exist_ok=True)
+
+        tokens_count = int(inputs["attention_mask"][i].sum())
+        for j in range(tokens_count):
+            np.savetxt(f"{sample_folder}/input_{j}.txt", emb[j].numpy(), delimiter=",")
+
+        # [CLS] после двух слоёв в открытом виде, без padding (как в FHE): client_inference_batch --encoder --plain
+        with torch.no_grad():
+            reference = partial_model(tokens_tensor[i:i + 1, :tokens_count].to(device), torch.ones(1, tokens_count, dtype=torch.long).to(device))
+        np.savetxt(f"{sample_folder}/reference.txt", reference[0, 0].cpu().numpy(), delimiter=",")
+
+        print(f"[INFO] {tokens_count} token embeddings saved to {sample_folder}")
+
+# --- Запускаем бинарь с аргументом ---
+def run_binary(extra_args=()):
+    global test_count
+
+    if os.path.exists(BINARY_DIR):
+        subprocess.run([BINARY_DIR + "/client_inference_batch",
+                        HS_FOLDER,
+                        OUTPUT_DIR,
+                        VERBOSE,
+                        *extra_args
+                        ]
+        )
+        test_count += 1
+    else:
+        print(f"[WARNING] Binary not found at {BINARY_DIR}")
+
+# --- То же, что run_binary, но в этом процессе ---
+def run_session(cls_hidden_states):
+    global session, test_count
+
+    if session is None:
+        session = fhe_bert.Session("keys", "encrypted_weights", bool(VERBOSE))
+
+    # float64 + C-order: буфер передаётся в C++ без копии
+    session.infer_batch(np.ascontiguousarray(cls_hidden_states, dtype=np.float64), OUTPUT_DIR)
+    print(f"[INFO] {len(cls_hidden_states)} results saved to {OUTPUT_DIR}")
+    test_count += 1
+
+# --- client_inference_batch --stream: uint32 count + float64[count] на запись ---
+def run_stream(records, extra_args=()):
+    global test_count
+
+    if not os.path.exists(BINARY_DIR):
+        print(f"[WARNING] Binary not found at {BINARY_DIR}")
+        return
+
+    args = [BINARY_DIR + "/client_inference_batch", "--stream", *extra_args]
+    if VERBOSE:
+        args.append(VERBOSE)
+    process = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    # Результаты читаются параллельно, пока следующие записи ещё готовятся
+    def read_results():
+        while True:
+            header = process.stdout.read(12)
+            if len(header) < 12:
+                break
+            index, size = struct.unpack("=IQ", header)
+            with open(f"{OUTPUT_DIR}/res_{index}.txt.enc", "wb") as f:
+                f.write(process.stdout.read(size))
+            print(f"[INFO] Result {index} saved to {OUTPUT_DIR}")
+
+    reader = threading.Thread(target=read_results)
+    reader.start()
+
+    for values in records:
+        values = np.ascontiguousarray(values, dtype=np.float64).ravel()
+        process.stdin.write(struct.pack("=I", values.size))
+        process.stdin.write(values.tobytes())
+        process.stdin.flush()
+
+    process.stdin.close()
+    reader.join()
+    process.wait()
+    test_count += 1
 
 def benchmark_batch():
     if os.path.exists(BINARY_DIR):
@@ -137,6 +268,21 @@ def benchmark_batch():
     else:
         print(f"[WARNING] Binary not found at {BINARY_DIR}")
 
+# --- Объединение батчей: benchmark_eval пишет <name>.partial (+ .count) на каждый запуск ---
+# Например, срезы BIAS_INDEX = 0, 32, 64, ... с разных машин:
+# merge_benchmarks(["bench_0.enc.partial", "bench_32.enc.partial"])
+def merge_benchmarks(partials, result_name=BENCH_RESULT_NAME):
+    if os.path.exists(BINARY_DIR):
+        subprocess.run([BINARY_DIR + "/benchmark_eval",
+                        "--merge",
+                        result_name,
+                        *partials,
+                        VERBOSE
+                        ]
+        )
+    else:
+        print(f"[WARNING] Binary not found at {BINARY_DIR}")
+
 
 def send_result():
     print(f"[INFO] Sending Anon result to {GEP_API}")
@@ -189,9 +335,13 @@ def evaluate_accuracy_with_slice(
 
 for i in range(0, len(texts), BATCH_SIZE):
     batch_texts = texts[i:i+BATCH_SIZE]
-    inference_batch(batch_texts)
+    inference_batch(batch_texts, i)
 
-benchmark_batch()
+# run_session/run_stream пишут res_i, им benchmark_eval по-прежнему нужен
+if not END_TO_END or (not ENCRYPTED_ENCODER and (USE_BINDINGS or STREAM_INPUT)):
+    benchmark_batch()
+else:
+    merge_benchmarks(evaluated_partials)
 
 acc = evaluate_accuracy_with_slice(batch_size=BATCH_SIZE, bias=BIAS_INDEX)
 print("Accuracy:", acc)
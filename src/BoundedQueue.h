@@ -0,0 +1,49 @@
+#ifndef FHE_BERT_BOUNDEDQUEUE_H
+#define FHE_BERT_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// FIFO between one producer and one consumer thread; push blocks while `capacity` items are waiting.
+// close() wakes everyone up: pop() then drains what is left and returns false once empty
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity == 0 ? 1 : capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) return;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+#endif
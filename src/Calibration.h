@@ -0,0 +1,121 @@
+#ifndef FHE_BERT_CALIBRATION_H
+#define FHE_BERT_CALIBRATION_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+/*
+ * Activation intervals, scales and Chebyshev degrees written by calibrate.py from the ranges of the plaintext
+ * model on a calibration set: "key = value" lines, '#' comments, a value can be a fraction ("1/30.0").
+ * The defaults are the hand-picked constants, so without a file nothing changes. The scales are folded into
+ * the weights by encrypt_weights: client_inference_batch has to get the file the weights were encrypted with.
+ */
+struct Calibration {
+    // Encoder layers: GELU on the intermediate dense output times gelu_scale, in [-1, 1]
+    double gelu_scale[2] = {1 / 13.5, 1 / 17.0};
+    int gelu_degree[2] = {119, 119};
+    // Encoder layers, not folded into the weights: sum of exp(scores) of a row (softmax), variance of the
+    // 128 features before the two LayerNorms (--exact-layernorm)
+    double softmax_sum_min[2] = {2, 2};
+    double softmax_sum_max[2] = {5000, 5000};
+    double layernorm_var_min[2] = {0.1, 0.1};
+    double layernorm_var_max[2] = {100, 100};
+    // Pooler: tanh on the dense output times tanh_scale, in [-1, 1]
+    double tanh_scale = 1 / 30.0;
+    int tanh_degree = 200;
+    // benchmark_eval / --evaluate: sign of 100 * (neg - pos) on [-sign_bound, sign_bound]
+    double sign_bound = 200.0;
+    int sign_degree = 25;
+
+    static Calibration load(const std::string &filename) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Can not open " << filename << std::endl;
+            exit(1);
+        }
+
+        Calibration calibration;
+        std::string line;
+        int number = 0;
+        while (std::getline(file, line)) {
+            number++;
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty()) continue;
+
+            size_t equal = line.find('=');
+            std::string key = equal == std::string::npos ? line : trim(line.substr(0, equal));
+            std::string value = equal == std::string::npos ? "" : trim(line.substr(equal + 1));
+            if (value.empty() || !calibration.set(key, value)) {
+                std::cerr << filename << ":" << number << ": invalid entry \"" << line << "\"" << std::endl;
+                exit(1);
+            }
+        }
+
+        return calibration;
+    }
+
+    // For the StageCache parameters: every value that changes the results
+    std::string describe() const {
+        char text[512];
+        snprintf(text, sizeof(text), "gelu=%.17g/%d,%.17g/%d;softmax=%.17g-%.17g,%.17g-%.17g;"
+                 "layernorm=%.17g-%.17g,%.17g-%.17g;tanh=%.17g/%d;sign=%.17g/%d",
+                 gelu_scale[0], gelu_degree[0], gelu_scale[1], gelu_degree[1],
+                 softmax_sum_min[0], softmax_sum_max[0], softmax_sum_min[1], softmax_sum_max[1],
+                 layernorm_var_min[0], layernorm_var_max[0], layernorm_var_min[1], layernorm_var_max[1],
+                 tanh_scale, tanh_degree, sign_bound, sign_degree);
+        return text;
+    }
+
+    // "1/27.5" or "0.036", exact enough to be passed on as text (encrypt_weights)
+    static double parse(const std::string &value) {
+        size_t slash = value.find('/');
+        if (slash == std::string::npos) return std::stod(value);
+
+        return std::stod(value.substr(0, slash)) / std::stod(value.substr(slash + 1));
+    }
+
+    static std::string format(double value) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.17g", value);
+        return text;
+    }
+
+private:
+    bool set(const std::string &key, const std::string &value) {
+        try {
+            if (key == "layer0.gelu_scale") gelu_scale[0] = parse(value);
+            else if (key == "layer0.gelu_degree") gelu_degree[0] = std::stoi(value);
+            else if (key == "layer1.gelu_scale") gelu_scale[1] = parse(value);
+            else if (key == "layer1.gelu_degree") gelu_degree[1] = std::stoi(value);
+            else if (key == "layer0.softmax_sum_min") softmax_sum_min[0] = parse(value);
+            else if (key == "layer0.softmax_sum_max") softmax_sum_max[0] = parse(value);
+            else if (key == "layer1.softmax_sum_min") softmax_sum_min[1] = parse(value);
+            else if (key == "layer1.softmax_sum_max") softmax_sum_max[1] = parse(value);
+            else if (key == "layer0.layernorm_var_min") layernorm_var_min[0] = parse(value);
+            else if (key == "layer0.layernorm_var_max") layernorm_var_max[0] = parse(value);
+            else if (key == "layer1.layernorm_var_min") layernorm_var_min[1] = parse(value);
+            else if (key == "layer1.layernorm_var_max") layernorm_var_max[1] = parse(value);
+            else if (key == "pooler.tanh_scale") tanh_scale = parse(value);
+            else if (key == "pooler.tanh_degree") tanh_degree = std::stoi(value);
+            else if (key == "eval.sign_bound") sign_bound = parse(value);
+            else if (key == "eval.sign_degree") sign_degree = std::stoi(value);
+            else return false;
+        } catch (const std::exception &) {
+            return false;
+        }
+
+        return true;
+    }
+
+    static std::string trim(const std::string &s) {
+        size_t first = s.find_first_not_of(" \t\r");
+        if (first == std::string::npos) return "";
+
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef FHE_BERT_CHACHA20_H
+#define FHE_BERT_CHACHA20_H
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * ChaCha20 keystream (original variant: 64-bit block counter, 64-bit nonce), used as the PRG that
+ * expands the seed of a seed-compressed ciphertext into its uniform component. Client and server
+ * must produce the very same stream, so it does not depend on the PRNG of the OpenFHE build.
+ */
+class ChaCha20 {
+public:
+    ChaCha20(const uint8_t key[32], uint64_t nonce) {
+        state[0] = 0x61707865;
+        state[1] = 0x3320646e;
+        state[2] = 0x79622d32;
+        state[3] = 0x6b206574;
+        for (int i = 0; i < 8; i++) state[4 + i] = load32(key + 4 * i);
+        state[12] = 0;
+        state[13] = 0;
+        state[14] = static_cast<uint32_t>(nonce);
+        state[15] = static_cast<uint32_t>(nonce >> 32);
+    }
+
+    uint64_t next64() {
+        if (position == 16) refill();
+        uint64_t low = block[position++];
+        uint64_t high = block[position++];
+        return low | (high << 32);
+    }
+
+    // Uniform in [0, modulus), by rejection on the smallest covering power of two
+    uint64_t uniform(uint64_t modulus) {
+        uint64_t mask = modulus - 1;
+        for (int shift = 1; shift < 64; shift <<= 1) mask |= mask >> shift;
+
+        uint64_t value;
+        do {
+            value = next64() & mask;
+        } while (value >= modulus);
+        return value;
+    }
+
+private:
+    static uint32_t load32(const uint8_t *p) {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    static uint32_t rotl(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    static void quarter_round(uint32_t *x, int a, int b, int c, int d) {
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+    }
+
+    void refill() {
+        memcpy(block, state, sizeof(block));
+        for (int round = 0; round < 10; round++) {
+            quarter_round(block, 0, 4, 8, 12);
+            quarter_round(block, 1, 5, 9, 13);
+            quarter_round(block, 2, 6, 10, 14);
+            quarter_round(block, 3, 7, 11, 15);
+            quarter_round(block, 0, 5, 10, 15);
+            quarter_round(block, 1, 6, 11, 12);
+            quarter_round(block, 2, 7, 8, 13);
+            quarter_round(block, 3, 4, 9, 14);
+        }
+        for (int i = 0; i < 16; i++) block[i] += state[i];
+
+        if (++state[12] == 0) state[13]++;
+        position = 0;
+    }
+
+    uint32_t state[16];
+    uint32_t block[16];
+    int position = 16;
+};
+
+#endif
@@ -4,6 +4,17 @@
 // Modified by Alex, founder@siroproject.tech
 
 #include "FHEController.h"
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <random>
+#include <omp.h>
+#include "ChaCha20.h"
+
+static bool raw_file(const string &filename);
 
 void FHEController::generate_context(bool serialize, bool secure) {
     CCParams<CryptoContextCKKSRNS> parameters;
@@ -52,6 +63,7 @@ void FHEController::generate_context(bool serialize, bool secure) {
     context->Enable(LEVELEDSHE);
     context->Enable(ADVANCEDSHE);
     context->Enable(FHE);
+    if (scheme_switching) context->Enable(SCHEMESWITCH);
 
     key_pair = context->KeyGen();
 
@@ -348,6 +360,96 @@ void FHEController::clear_rotation_keys() {
     context->ClearEvalAutomorphismKeys();
 }
 
+// Параметры переключения CKKS -> FHEW: все слоты контекста (логиты лежат в первых n слотах
+// ciphertext'а на 16384 слота, разреженная упаковка требовала бы периодичности), FHEW с 25-битным модулем.
+// FHEW на STD128; CKKS-часть наследует уровень основного контекста (HEStd_NotSet, только для бенчмарков)
+static SchSwchParams scheme_switching_parameters(int slots) {
+    SchSwchParams params;
+    params.SetSecurityLevelCKKS(HEStd_NotSet);
+    params.SetSecurityLevelFHEW(STD128);
+    params.SetCtxtModSizeFHEWLargePrec(25);
+    params.SetNumSlotsCKKS(slots);
+    params.SetNumValues(slots);
+    return params;
+}
+
+void FHEController::generate_scheme_switching_keys(bool serialize) {
+    if (!scheme_switching) {
+        cerr << "Scheme switching keys need a context generated with scheme_switching = true" << endl;
+        exit(1);
+    }
+
+    // The CKKS <-> FHEW automorphism keys go to the shared map: only the indices added here are saved
+    // with the scheme switching keys, the rotation keys keep their own file
+    string tag = key_pair.secretKey->GetKeyTag();
+    auto &automorphism_keys = CryptoContextImpl<DCRTPoly>::GetAllEvalAutomorphismKeys();
+    map<uint32_t, EvalKey<DCRTPoly>> existing_keys;
+    if (automorphism_keys.count(tag)) existing_keys = *automorphism_keys[tag];
+
+    LWEPrivateKey fhew_key = context->EvalSchemeSwitchingSetup(scheme_switching_parameters(num_slots));
+    auto binfhe = context->GetBinCCForSchemeSwitch();
+    binfhe->BTKeyGen(fhew_key);
+    context->EvalSchemeSwitchingKeyGen(key_pair, fhew_key);
+    context->EvalCompareSwitchPrecompute(scheme_switch_plwe, scheme_switch_scale);
+
+    cout << "Scheme switching keys generated." << endl;
+
+    if (!serialize) {
+        return;
+    }
+
+    auto switching_keys = make_shared<map<uint32_t, EvalKey<DCRTPoly>>>();
+    for (const auto &key : *automorphism_keys[tag]) {
+        if (!existing_keys.count(key.first)) switching_keys->insert(key);
+    }
+
+    // The context is saved again: generate_context wrote it before the setup, without the scheme
+    // switching state (CKKS -> FHEW precomputations and switching key)
+    if (!Serial::SerializeToFile(parameters_folder + "/crypto-context.txt", context, SerType::BINARY) ||
+        !Serial::SerializeToFile(parameters_folder + "/scheme-switching-automorphism-keys.txt", switching_keys, SerType::BINARY) ||
+        !Serial::SerializeToFile(parameters_folder + "/binfhe-context.txt", *binfhe, SerType::BINARY) ||
+        !Serial::SerializeToFile(parameters_folder + "/binfhe-refresh-key.txt", binfhe->GetRefreshKey(), SerType::BINARY) ||
+        !Serial::SerializeToFile(parameters_folder + "/binfhe-switch-key.txt", binfhe->GetSwitchKey(), SerType::BINARY) ||
+        !Serial::SerializeToFile(parameters_folder + "/fhew-ckks-switch-key.txt", context->GetSwkFC(), SerType::BINARY)) {
+        cerr << "Error writing scheme switching keys to " << parameters_folder << endl;
+        exit(1);
+    }
+
+    cout << "Scheme switching keys have been serialized" << endl;
+}
+
+void FHEController::load_scheme_switching_keys(bool verbose) {
+    if (verbose) cout << endl << "Loading scheme switching keys..." << endl;
+
+    auto start = start_time();
+
+    // The CKKS side of the scheme switching comes with crypto-context.txt (load_context), saved
+    // after the setup: calling the setup again would replace it with a state for another FHEW key
+    auto binfhe = make_shared<BinFHEContext>();
+    RingGSWACCKey refresh_key;
+    LWESwitchingKey switch_key;
+    Ctxt fhew_ckks_key;
+    shared_ptr<map<uint32_t, EvalKey<DCRTPoly>>> switching_keys;
+
+    if (!Serial::DeserializeFromFile(parameters_folder + "/scheme-switching-automorphism-keys.txt", switching_keys, SerType::BINARY) ||
+        !Serial::DeserializeFromFile(parameters_folder + "/binfhe-context.txt", *binfhe, SerType::BINARY) ||
+        !Serial::DeserializeFromFile(parameters_folder + "/binfhe-refresh-key.txt", refresh_key, SerType::BINARY) ||
+        !Serial::DeserializeFromFile(parameters_folder + "/binfhe-switch-key.txt", switch_key, SerType::BINARY) ||
+        !Serial::DeserializeFromFile(parameters_folder + "/fhew-ckks-switch-key.txt", fhew_ckks_key, SerType::BINARY)) {
+        cerr << "I cannot read scheme switching keys from " << parameters_folder
+             << " (generate them with encrypt_weights --scheme-switching)" << endl;
+        exit(1);
+    }
+
+    CryptoContextImpl<DCRTPoly>::InsertEvalAutomorphismKey(switching_keys, key_pair.publicKey->GetKeyTag());
+    binfhe->BTKeyLoad({refresh_key, switch_key});
+    context->SetBinCCForSchemeSwitch(binfhe);
+    context->SetSwkFC(fhew_ckks_key);
+    context->EvalCompareSwitchPrecompute(scheme_switch_plwe, scheme_switch_scale);
+
+    if (verbose) print_duration(start, "Loading scheme switching keys");
+}
+
 void FHEController::clear_context(int bootstrapping_key_slots) {
     if (bootstrapping_key_slots != 0)
         clear_bootstrapping_and_rotation_keys(bootstrapping_key_slots);
@@ -415,6 +517,150 @@ Ctxt FHEController::encrypt_ptxt(const Ptxt& p) {
     return context->Encrypt(p, key_pair.publicKey);
 }
 
+SeededCtxt FHEController::encrypt_seeded(const vector<double> &vec, int level, int plaintext_num_slots) {
+    if (plaintext_num_slots == 0) {
+        plaintext_num_slots = num_slots;
+    }
+
+    return encrypt_ptxt_seeded(encode(vec, level, plaintext_num_slots));
+}
+
+// Same as the secret-key Encrypt of OpenFHE, b = a*(-s) + e + m, except that a comes from a fresh seed
+SeededCtxt FHEController::encrypt_ptxt_seeded(const Ptxt &p) {
+    if (!key_pair.secretKey) {
+        cerr << "Seeded encryption needs the secret key (load_context with verbose)" << endl;
+        exit(1);
+    }
+
+    SeededCtxt result;
+    random_device entropy;
+    for (size_t i = 0; i < result.seed.size(); i += 4) {
+        uint32_t word = entropy();
+        memcpy(result.seed.data() + i, &word, 4);
+    }
+
+    DCRTPoly m = p->GetElement<DCRTPoly>();
+    m.SetFormat(Format::EVALUATION);
+    const shared_ptr<DCRTPoly::Params> params = m.GetParams();
+
+    DCRTPoly s = key_pair.secretKey->GetPrivateElement();
+    s.DropLastElements(s.GetNumOfElements() - m.GetNumOfElements());
+
+    const auto crypto_parameters = dynamic_pointer_cast<CryptoParametersRNS>(context->GetCryptoParameters());
+    DCRTPoly e(crypto_parameters->GetDiscreteGaussianGenerator(), params, Format::EVALUATION);
+    DCRTPoly a = expand_seed(result.seed, params);
+
+    DCRTPoly b = e - a * s;
+    b += m;
+
+    result.c = make_shared<CiphertextImpl<DCRTPoly>>(context);
+    result.c->SetElements({std::move(b), std::move(a)});
+    result.c->SetEncodingType(p->GetEncodingType());
+    result.c->SetKeyTag(key_pair.secretKey->GetKeyTag());
+    result.c->SetLevel(p->GetLevel());
+    result.c->SetNoiseScaleDeg(p->GetNoiseScaleDeg());
+    result.c->SetScalingFactor(p->GetScalingFactor());
+    result.c->SetSlots(p->GetSlots());
+
+    return result;
+}
+
+Ctxt FHEController::encrypt_zero(int level) {
+    return context->Encrypt(encode(0.0, level, num_slots), key_pair.publicKey);
+}
+
+Ctxt FHEController::encrypt_pooled(const Ptxt& p) {
+    Ctxt zero;
+    {
+        lock_guard<mutex> lock(zero_pool->m);
+        if (!zero_pool->zeros.empty() && static_cast<int>(p->GetLevel()) == zero_pool->level) {
+            zero = zero_pool->zeros.front();
+            zero_pool->zeros.pop_front();
+        }
+    }
+    zero_pool->changed.notify_all();
+
+    if (!zero) return encrypt_ptxt(p);
+
+    return context->EvalAdd(zero, p);
+}
+
+void FHEController::start_zero_pool(size_t target, int level) {
+    stop_zero_pool();
+
+    zero_pool->target = target;
+    zero_pool->level = level;
+    zero_pool->stop = false;
+
+    // Refill in the background whenever encrypt_pooled takes a zero
+    zero_pool->refill = thread([this, level]() {
+        while (true) {
+            {
+                unique_lock<mutex> lock(zero_pool->m);
+                zero_pool->changed.wait(lock, [this]() {
+                    return zero_pool->stop || zero_pool->zeros.size() < zero_pool->target;
+                });
+                if (zero_pool->stop) return;
+            }
+
+            Ctxt zero = encrypt_zero(level);
+
+            lock_guard<mutex> lock(zero_pool->m);
+            zero_pool->zeros.push_back(zero);
+        }
+    });
+}
+
+void FHEController::stop_zero_pool() {
+    {
+        lock_guard<mutex> lock(zero_pool->m);
+        zero_pool->stop = true;
+    }
+    zero_pool->changed.notify_all();
+
+    if (zero_pool->refill.joinable()) zero_pool->refill.join();
+}
+
+void FHEController::precompute_zeros(const string &folder, int count, int level) {
+    filesystem::create_directories(folder);
+
+    // Unique names: several precompute passes may feed the same folder
+    string prefix = folder + "/zero_l" + to_string(level) + "_" + to_string(getpid()) + "_" +
+                    to_string(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count()) + "_";
+
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        string filename = prefix + to_string(i) + ".enc";
+        save_raw(encrypt_zero(level), filename + ".tmp");
+        filesystem::rename(filename + ".tmp", filename);
+    }
+}
+
+Ctxt FHEController::encrypt_from_pool(const Ptxt& p, const string &folder) {
+    string wanted = "zero_l" + to_string(p->GetLevel()) + "_";
+
+    if (filesystem::is_directory(folder)) {
+        for (const auto &entry : filesystem::directory_iterator(folder)) {
+            string name = entry.path().filename().string();
+            if (name.rfind(wanted, 0) != 0 || entry.path().extension() != ".enc") continue;
+
+            // rename is atomic: only one process can claim a given zero
+            string claimed = entry.path().string() + ".claimed." + to_string(getpid());
+            error_code error;
+            filesystem::rename(entry.path(), claimed, error);
+            if (error) continue;
+
+            Ctxt zero = load_ciphertext(claimed);
+            filesystem::remove(claimed);
+
+            return context->EvalAdd(zero, p);
+        }
+    }
+
+    cerr << "No precomputed zero left in \"" << folder << "\", encrypting online" << endl;
+    return encrypt_ptxt(p);
+}
+
 Ptxt FHEController::decrypt(const Ctxt &c) {
     Ptxt p;
     context->Decrypt(key_pair.secretKey, c, &p);
@@ -441,17 +687,21 @@ Ctxt FHEController::add(const Ctxt &c1, const Ctxt &c2) {
     return context->EvalAdd(c1, c2);
 }
 
-Ctxt FHEController::add(const Ctxt &c1, Ptxt &c2) {
+Ctxt FHEController::add(const Ctxt &c1, const Ptxt &c2) {
     return context->EvalAdd(c1, c2);
 }
 
-Ctxt FHEController::add(vector<Ctxt> c) {
+Ctxt FHEController::add(const vector<Ctxt> &c) {
     return context->EvalAddMany(c);
 }
 
+Ctxt FHEController::sub(const Ctxt &c1, const Ctxt &c2) {
+    return context->EvalSub(c1, c2);
+}
+
 Ctxt FHEController::mult(const Ctxt &c1, double d) {
-    Ptxt p = encode(d, c1->GetLevel(), num_slots);
-    return context->EvalMult(c1, p);
+    //Native scalar multiplication, no need to encode a full plaintext
+    return context->EvalMult(c1, d);
 }
 
 Ctxt FHEController::mult(const Ctxt &c, const Ptxt& p) {
@@ -466,6 +716,48 @@ Ctxt FHEController::rotate(const Ctxt &c, int index) {
     return context->EvalRotate(c, index);
 }
 
+void FHEController::add_inplace(Ctxt &c1, const Ctxt &c2) {
+    context->EvalAddInPlace(c1, c2);
+}
+
+void FHEController::add_inplace(Ctxt &c, const Ptxt &p) {
+    context->EvalAddInPlace(c, p);
+}
+
+void FHEController::add_inplace(Ctxt &c, double d) {
+    context->EvalAddInPlace(c, d);
+}
+
+void FHEController::sub_inplace(Ctxt &c1, const Ctxt &c2) {
+    context->EvalSubInPlace(c1, c2);
+}
+
+void FHEController::sub_inplace(Ctxt &c, const Ptxt &p) {
+    context->EvalSubInPlace(c, p);
+}
+
+void FHEController::mult_inplace(Ctxt &c, double d) {
+    context->EvalMultInPlace(c, d);
+}
+
+void FHEController::mult_inplace(Ctxt &c, const Ptxt &p) {
+    context->EvalMultInPlace(c, p);
+}
+
+void FHEController::rotate_inplace(Ctxt &c, int index) {
+    //OpenFHE has no in-place automorphism: the key switch always produces a new ciphertext,
+    //but the old one is released here instead of being kept alive by the caller
+    c = context->EvalRotate(c, index);
+}
+
+void FHEController::rescale_inplace(Ctxt &c) {
+    //With FLEXIBLEAUTO RescaleInPlace() is a no-op (rescaling is deferred to the next multiplication),
+    //so the scheme is called directly. Nothing to do if the ciphertext is already at scale degree 1
+    if (c->GetNoiseScaleDeg() > 1) {
+        context->GetScheme()->ModReduceInternalInPlace(c, BASE_NUM_LEVELS_TO_DROP);
+    }
+}
+
 Ctxt FHEController::bootstrap(const Ctxt &c, bool timing) {
     //if (static_cast<int>(c->GetLevel()) + 2 < circuit_depth) {
     //    cout << "You are bootstrapping with remaining levels! You are at " << to_string(c->GetLevel()) << "/" << circuit_depth - 2 << endl;
@@ -610,20 +902,28 @@ Ptxt FHEController::read_plain_repeated_input(const string& filename, int level,
     //Assumption: inputs have 128 values
     vector<double> input = read_values_from_file(filename);
 
-    vector<double> repeated;
+    return encode_repeated(input.data(), 128, level, scale);
+}
 
-    for (int j = 0; j < 128; j++) {
-        for (int i = 0; i < 128; i++) {
-            repeated.push_back(input[i]);
-        }
+Ptxt FHEController::encode_repeated(const double *values, int period, int level, double scale) {
+    //Reads the caller's buffer in place (NumPy arrays from the Python bindings), values[i % period] in slot i
+    vector<double> repeated(num_slots);
+
+    for (int i = 0; i < num_slots; i++) {
+        repeated[i] = values[i % period] * scale;
     }
 
-    int size = static_cast<int>(repeated.size());
+    return context->MakeCKKSPackedPlaintext(repeated, 1, level, nullptr, num_slots);
+}
 
-    if (scale != 1) {
-        for (int i = 0; i < size; i++) {
-            repeated[i] = repeated[i] * scale;
-        }
+Ptxt FHEController::read_plain_repeated_input(const string& filename, int level, double scale, int period) {
+    //Generalization of the repeated layout: the first `period` values are repeated over all the slots
+    vector<double> input = read_values_from_file(filename, scale);
+
+    vector<double> repeated(num_slots);
+
+    for (int i = 0; i < num_slots; i++) {
+        repeated[i] = input[i % period];
     }
 
     return context->MakeCKKSPackedPlaintext(repeated, 1, level, nullptr, num_slots);
@@ -679,23 +979,18 @@ Ptxt FHEController::read_plain_expanded_input(const string& filename, int level,
     //Assumption: inputs have 128 values
     vector<double> input = read_values_from_file(filename);
 
-    vector<double> repeated;
-
-    for (int j = 0; j < 128; j++) {
-        for (int i = 0; i < 128; i++) {
-            repeated.push_back(input[j]);
-        }
-    }
+    return encode_expanded(input.data(), level, scale);
+}
 
-    int size = static_cast<int>(repeated.size());
+Ptxt FHEController::encode_expanded(const double *values, int level, double scale) {
+    //values[j] in slots 128j..128j+127
+    vector<double> expanded(num_slots);
 
-    if (scale != 1) {
-        for (int i = 0; i < size; i++) {
-            repeated[i] = repeated[i] * scale;
-        }
+    for (int i = 0; i < num_slots; i++) {
+        expanded[i] = values[i / 128] * scale;
     }
 
-    return context->MakeCKKSPackedPlaintext(repeated, 1, level, nullptr, num_slots);
+    return context->MakeCKKSPackedPlaintext(expanded, 1, level, nullptr, num_slots);
 }
 
 Ptxt FHEController::read_plain_expanded_input(const string& filename, int level, double scale, int num_inputs) {
@@ -854,202 +1149,335 @@ void FHEController::print_min_max(const Ctxt &c) {
 
 
 Ctxt FHEController::rotsum(const Ctxt &in, int slots, int padding) {
-    Ctxt result = in->Clone();
+    // A fresh ciphertext in every case: the result may be modified in place by the caller
+    if (slots <= 1) return in->Clone();
 
-    for (int i = 0; i < log2(slots); i++) {
-        result = add(result, context->EvalRotate(result, padding * pow(2, i)));
+    //The first addition allocates the result, the others accumulate on it
+    Ctxt result = add(in, context->EvalRotate(in, padding));
+
+    for (int i = 1; i < log2(slots); i++) {
+        add_inplace(result, context->EvalRotate(result, padding * pow(2, i)));
     }
 
     return result;
 }
 
 Ctxt FHEController::rotsum_padded(const Ctxt &in, int slots) {
-    Ctxt result = in->Clone();
+    return rotsum(in, slots, slots);
+}
+
+Ctxt FHEController::repeat(const Ctxt &in, int slots) {
+    return repeat(in, slots, 1);
+}
+
+Ctxt FHEController::repeat(const Ctxt &in, int slots, int padding) {
+    // Same as rotsum: never the caller's ciphertext
+    if (slots <= 1) return in->Clone();
+
+    Ctxt res = add(in, rotate(in, -padding));
 
-    for (int i = 0; i < log2(slots); i++) {
-        result = add(result, context->EvalRotate(result, slots * pow(2, i)));
+    for (int i = 1; i < log2(slots); i++) {
+        add_inplace(res, rotate(res, padding * (-pow(2, i))));
     }
 
-    return result;
+    return res;
 }
 
-Ctxt FHEController::repeat(const Ctxt &in, int slots) {
-    Ctxt res = in->Clone();
+vector<Ctxt> FHEController::matmulRE(const vector<Ctxt> &rows, Ctxt &weight, Ctxt &bias) {
+    return matmulRE(rows, weight, bias, 128, 128);
+}
 
-    for (int i = 0; i < log2(slots); i++) {
-        res = add(res, rotate(res, -pow(2, i)));
+vector<Ctxt> FHEController::matmulRE(const vector<Ctxt> &rows, Ctxt &weight, Ctxt &bias, int row_size, int padding) {
+    vector<Ctxt> columns(rows.size());
+
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < rows.size(); i++) {
+        omp_set_num_threads(inner);
+        columns[i] = dot_product({rows[i]}, {weight}, row_size, padding, bias);
     }
 
-    return res;
+    return columns;
 }
 
-Ctxt FHEController::repeat(const Ctxt &in, int slots, int padding) {
-    Ctxt res = in->Clone();
+vector<Ctxt> FHEController::matmulRE(const vector<Ctxt> &rows, Ctxt &weight, int row_size, int padding) {
+    vector<Ctxt> columns(rows.size());
 
-    for (int i = 0; i < log2(slots); i++) {
-        res = add(res, rotate(res, padding * (-pow(2, i))));
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < rows.size(); i++) {
+        omp_set_num_threads(inner);
+        columns[i] = dot_product({rows[i]}, {weight}, row_size, padding);
     }
 
-    return res;
+    return columns;
 }
 
-vector<Ctxt> FHEController::matmulRE(vector<Ctxt> rows, Ctxt &weight, Ctxt &bias) {
-    vector<Ctxt> columns;
+vector<Ctxt> FHEController::matmulRElarge(const vector<Ctxt> &inputs, const vector<Ctxt> &weights, Ctxt &bias, double mask_val) {
+    vector<Ctxt> densed(inputs.size());
+
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < inputs.size(); i++) {
+        omp_set_num_threads(inner);
+        Ctxt i_th_result;
+        int last = weights.size() - 1;
+        for (int j = last; j >= 0; j--) {
+            Ctxt out = mult(inputs[i], weights[j]);
+            out = rotsum(out, 128, 128);
+
+            out = mask_first_n(out, 128, mask_val);
+
+            if (j == last)
+                i_th_result = std::move(out);
+            else {
+                //i_th_result = rotate(i_th_result, -128);
+                rotate_inplace(i_th_result, -64);
+                rotate_inplace(i_th_result, -64);
 
-    for (int i = 0; i < rows.size(); i++) {
-        Ctxt m = mult(rows[i], weight);
+                add_inplace(i_th_result, out);
+            }
 
-        m = rotsum(m, 128, 128);
+        }
 
-        if (bias != nullptr) m = add(m, bias);
+        add_inplace(i_th_result, bias);
 
-        columns.push_back(m);
+        densed[i] = std::move(i_th_result);
     }
 
-    return columns;
+    return densed;
 }
 
-vector<Ctxt> FHEController::matmulRE(vector<Ctxt> rows, Ctxt &weight, Ctxt &bias, int row_size, int padding) {
-    vector<Ctxt> columns;
+vector<Ctxt> FHEController::matmulCR(const vector<Ctxt> &rows, Ctxt& matrix) {
+    vector<Ctxt> columns(rows.size());
 
-    for (int i = 0; i < rows.size(); i++) {
-        Ctxt m = mult(rows[i], weight);
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < rows.size(); i++) {
+        omp_set_num_threads(inner);
+        columns[i] = dot_product({rows[i]}, {matrix}, 64, 1);
+    }
 
-        m = rotsum(m, row_size, padding);
+    return columns;
+}
 
-        if (bias != nullptr) m = add(m, bias);
+vector<Ctxt> FHEController::matmulCR(const vector<Ctxt> &rows, Ctxt& weight, Ctxt& bias) {
+    vector<Ctxt> columns(rows.size());
 
-        columns.push_back(m);
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < rows.size(); i++) {
+        omp_set_num_threads(inner);
+        columns[i] = dot_product({rows[i]}, {weight}, 128, 1, bias);
     }
 
     return columns;
 }
 
-vector<Ctxt> FHEController::matmulRE(vector<Ctxt> rows, Ctxt &weight, int row_size, int padding) {
-    vector<Ctxt> columns;
+vector<Ctxt> FHEController::matmulCRlarge(const vector<vector<Ctxt>> &rows, const vector<Ctxt> &weights, Ctxt &bias) {
+    vector<Ctxt> output(rows.size());
+
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (size_t i = 0; i < rows.size(); i++) {
+        omp_set_num_threads(inner);
+        //The four products are summed before relinearizing, then a single rotsum is done on the sum
+        output[i] = dot_product(rows[i], weights, 128, 1, bias);
+    }
 
-    for (int i = 0; i < rows.size(); i++) {
-        Ctxt m = mult(rows[i], weight);
+    return output;
+}
 
-        m = rotsum(m, row_size, padding);
+Ctxt FHEController::mult_accumulate(const vector<Ctxt> &lhs, const vector<Ctxt> &rhs) {
+    //Products are kept in the 3-element (non relinearized) form and summed, so the key switch
+    //is paid once for the whole sum instead of once per term
+    Ctxt acc = context->EvalMultNoRelin(lhs[0], rhs[0]);
 
-        columns.push_back(m);
+    for (size_t i = 1; i < lhs.size(); i++) {
+        add_inplace(acc, context->EvalMultNoRelin(lhs[i], rhs[i]));
     }
 
-    return columns;
+    context->RelinearizeInPlace(acc);
+
+    //Rescaling here (instead of lazily at the next multiplication) also makes the following
+    //rotations key switch one tower less
+    rescale_inplace(acc);
+
+    return acc;
 }
 
-vector<Ctxt> FHEController::matmulRElarge(vector<Ctxt>& inputs, vector<Ctxt> &weights, Ctxt &bias, double mask_val) {
-    vector<Ctxt> densed;
+Ctxt FHEController::dot_product(const vector<Ctxt> &lhs, const vector<Ctxt> &rhs, int row_size, int padding, const Ctxt &bias) {
+    Ctxt res = rotsum(mult_accumulate(lhs, rhs), row_size, padding);
 
-    for (int i = 0; i < inputs.size(); i++) {
-        Ctxt i_th_result;
-        for (int j = weights.size() - 1; j >= 0; j--) {
-            Ctxt out = mult(inputs[i], weights[j]);
-            out = rotsum(out, 128, 128);
+    if (bias != nullptr) add_inplace(res, bias);
 
-            out = mask_first_n(out, 128, mask_val);
+    return res;
+}
 
-            if (j == weights.size() - 1)
-                i_th_result = out;
-            else {
-                //i_th_result = rotate(i_th_result, -128);
-                i_th_result = rotate(i_th_result, -64);
-                i_th_result = rotate(i_th_result, -64);
+// Outer loops over independent ciphertexts (tokens, score rows, containers) run on ciphertext_workers
+// threads; the OpenFHE operations inside each iteration get the remaining cores, so the two levels
+// together never run more threads than omp_get_max_threads()
+int FHEController::nested_threads() const {
+    return max(1, omp_get_max_threads() / max(1, ciphertext_workers));
+}
 
-                i_th_result = add(i_th_result, out);
-            }
+Ctxt FHEController::matmulScores(const vector<Ctxt> &queries, Ctxt &key) {
+    vector<Ctxt> scores = matmulCR(queries, key);
 
-        }
+    double r = softmax_r; //Later corrected with e^(x/r)
+
+    Ctxt scores_wrapped = mask_heads(scores[scores.size() - 1], 1 / 8.0 * r);
+    rotate_inplace(scores_wrapped, -1);
 
-        i_th_result = add(i_th_result, bias);
+    for (int i = scores.size() - 2; i >= 0; i--) {
+        add_inplace(scores_wrapped, mask_heads(scores[i], 1 / 8.0 * r));
 
-        densed.push_back(i_th_result);
+        if (i > 0) rotate_inplace(scores_wrapped, -1);
     }
 
-    return densed;
+    return scores_wrapped;
 }
 
-vector<Ctxt> FHEController::matmulCR(vector<Ctxt> rows, Ctxt& matrix) {
-    vector<Ctxt> columns;
+/*
+ * Baby-step/giant-step diagonal method.
+ * Diagonal k of a d_out x d_in matrix W is diag_k[j] = W[j % d_out][(j + k) % d_in], j < max(d_in, d_out).
+ * Only min(d_in, d_out) diagonals are needed: when d_in > d_out the partial sums are folded with a
+ * rotsum of stride d_out. Diagonal k = g * n1 + b is stored pre-rotated by -g * n1, so that
+ *     W x = sum_g rot(sum_b diag'_k * rot(x, b), g * n1)
+ * needs n1 - 1 hoisted baby-step rotations of the input and n2 - 1 giant-step rotations.
+ */
+int FHEController::bsgs_baby_steps(int diagonals) {
+    int baby_steps = 1;
+
+    while (baby_steps * baby_steps < diagonals) {
+        baby_steps *= 2;
+    }
+
+    return baby_steps;
+}
 
-    for (int i = 0; i < rows.size(); i++) {
-        Ctxt m = mult(rows[i], matrix);
+vector<int> FHEController::bsgs_rotation_indices(int d_in, int d_out) {
+    int diagonals = min(d_in, d_out);
+    int baby_steps = bsgs_baby_steps(diagonals);
 
-        m = rotsum(m, 64, 1);
+    vector<int> indices;
 
-        columns.push_back(m);
+    for (int b = 1; b < baby_steps && b < diagonals; b++) {
+        indices.push_back(b);
+    }
+    for (int g = baby_steps; g < diagonals; g += baby_steps) {
+        indices.push_back(g);
+    }
+    for (int s = d_out; s < d_in; s *= 2) {
+        indices.push_back(s);
     }
 
-    return columns;
+    return indices;
 }
 
-vector<Ctxt> FHEController::matmulCR(vector<Ctxt> rows, Ctxt& weight, Ctxt& bias) {
-    vector<Ctxt> columns;
+vector<vector<double>> FHEController::matrix_diagonals(const vector<double> &matrix, int d_in, int d_out, bool transposed) {
+    //matrix is W[d_out][d_in] row-major, or W^T[d_in][d_out] if transposed (as the dense weights in weights-sst2)
+    int block = max(d_in, d_out);
+    int diagonals = min(d_in, d_out);
+    int baby_steps = bsgs_baby_steps(diagonals);
 
-    for (int i = 0; i < rows.size(); i++) {
-        Ctxt m = mult(rows[i], weight);
+    vector<vector<double>> result(diagonals, vector<double>(num_slots));
 
-        m = rotsum(m, 128, 1);
+    for (int k = 0; k < diagonals; k++) {
+        int giant_shift = (k / baby_steps) * baby_steps;
 
-        if (bias != nullptr) m = add(m, bias);
+        //Replicated with period block over all the slots, so the pre-rotation wraps correctly
+        for (int t = 0; t < num_slots; t++) {
+            int j = ((t - giant_shift) % block + block) % block;
+            int row = j % d_out;
+            int col = (j + k) % d_in;
 
-        columns.push_back(m);
+            result[k][t] = transposed ? matrix[col * d_out + row] : matrix[row * d_in + col];
+        }
     }
 
-    return columns;
+    return result;
 }
 
-vector<Ctxt> FHEController::matmulCRlarge(vector<vector<Ctxt>> rows, vector<Ctxt> weights, Ctxt &bias) {
-    vector<Ctxt> output;
+vector<Ptxt> FHEController::read_plain_diagonals(const string& filename, int d_in, int d_out, int level, double scale, bool transposed) {
+    vector<double> matrix = read_values_from_file(filename, scale);
 
-    for (int i = 0; i < rows.size(); i++) {
-        //Qua sotto posso fare prima add-many e poi un solo rotsum mi sa:)
-        /*
-        Ctxt p1 = rotsum(mult(rows[i][0], weights[0]), 128, 1);
-        Ctxt p2 = rotsum(mult(rows[i][1], weights[1]), 128, 1);
-        Ctxt p3 = rotsum(mult(rows[i][2], weights[2]), 128, 1);
-        Ctxt p4 = rotsum(mult(rows[i][3], weights[3]), 128, 1);
+    vector<Ptxt> result;
+    for (const vector<double> &diagonal : matrix_diagonals(matrix, d_in, d_out, transposed)) {
+        result.push_back(context->MakeCKKSPackedPlaintext(diagonal, 1, level, nullptr, num_slots));
+    }
 
-        Ctxt res = add({p1, p2, p3, p4});
-        */
+    return result;
+}
 
-        Ctxt p1 = mult(rows[i][0], weights[0]);
-        Ctxt p2 = mult(rows[i][1], weights[1]);
-        Ctxt p3 = mult(rows[i][2], weights[2]);
-        Ctxt p4 = mult(rows[i][3], weights[3]);
+Ctxt FHEController::diagonal_block(const vector<Ctxt> &babies, const vector<Ctxt> &diagonals, int first, int count) {
+    //Encrypted diagonals: one relinearization for the whole giant step
+    vector<Ctxt> lhs(babies.begin(), babies.begin() + count);
+    vector<Ctxt> rhs(diagonals.begin() + first, diagonals.begin() + first + count);
 
-        Ctxt res = add({p1, p2, p3, p4});
-        res = rotsum(res, 128, 1);
+    return mult_accumulate(lhs, rhs);
+}
 
-        if (bias != nullptr) res = add(res, bias);
+Ctxt FHEController::diagonal_block(const vector<Ctxt> &babies, const vector<Ptxt> &diagonals, int first, int count) {
+    Ctxt acc = mult(babies[0], diagonals[first]);
 
-        output.push_back(res);
+    for (int b = 1; b < count; b++) {
+        add_inplace(acc, mult(babies[b], diagonals[first + b]));
     }
 
-    return output;
+    rescale_inplace(acc);
+
+    return acc;
 }
 
-Ctxt FHEController::matmulScores(vector<Ctxt> queries, Ctxt &key) {
-    vector<Ctxt> scores = matmulCR(queries, key);
+template <typename T>
+Ctxt FHEController::matvec_bsgs_impl(const Ctxt &in, const vector<T> &diagonals, int d_in, int d_out) {
+    int num_diagonals = diagonals.size();
+    int baby_steps = bsgs_baby_steps(num_diagonals);
 
-    double r = 1 / 8.0; //Later corrected with e^(x/r)
+    //All the baby steps rotate the same ciphertext, so the digit decomposition is computed once
+    auto digits = context->EvalFastRotationPrecompute(in);
+    uint32_t m = context->GetCyclotomicOrder();
 
-    Ctxt scores_wrapped = mask_heads(scores[scores.size() - 1], 1 / 8.0 * r);
-    scores_wrapped = rotate(scores_wrapped, -1);
+    vector<Ctxt> babies;
+    babies.push_back(in);
+    for (int b = 1; b < baby_steps && b < num_diagonals; b++) {
+        babies.push_back(context->EvalFastRotation(in, b, m, digits));
+    }
 
-    for (int i = scores.size() - 2; i >= 0; i--) {
-        scores_wrapped = add(scores_wrapped,
-                             mask_heads(scores[i], 1 / 8.0 * r));
+    Ctxt result;
+
+    for (int first = 0; first < num_diagonals; first += baby_steps) {
+        int count = min(baby_steps, num_diagonals - first);
+
+        Ctxt partial = diagonal_block(babies, diagonals, first, count);
+
+        if (first == 0) {
+            result = std::move(partial);
+        } else {
+            rotate_inplace(partial, first);
+            add_inplace(result, partial);
+        }
+    }
 
-        if (i > 0) scores_wrapped = rotate(scores_wrapped, -1);
+    if (d_in > d_out) {
+        result = rotsum(result, d_in / d_out, d_out);
     }
 
-    return scores_wrapped;
+    return result;
+}
+
+Ctxt FHEController::matvec_bsgs(const Ctxt &in, const vector<Ctxt> &diagonals, int d_in, int d_out) {
+    return matvec_bsgs_impl(in, diagonals, d_in, d_out);
+}
+
+Ctxt FHEController::matvec_bsgs(const Ctxt &in, const vector<Ptxt> &diagonals, int d_in, int d_out) {
+    return matvec_bsgs_impl(in, diagonals, d_in, d_out);
 }
 
-Ctxt FHEController::wrapUpRepeated(vector<Ctxt> vectors) {
+Ctxt FHEController::wrapUpRepeated(const vector<Ctxt> &vectors) {
     vector<Ctxt> masked;
+    masked.reserve(vectors.size());
 
     for (int i = 0; i < vectors.size(); i++) {
         masked.push_back(mask_block(vectors[i], 128 * i, 128 * (i + 1), 1));
@@ -1058,16 +1486,16 @@ Ctxt FHEController::wrapUpRepeated(vector<Ctxt> vectors) {
     return context->EvalAddMany(masked);
 }
 
-Ctxt FHEController::wrapUpExpanded(vector<Ctxt> vectors) {
+Ctxt FHEController::wrapUpExpanded(const vector<Ctxt> &vectors) {
     //I use a vector to contain all the partial computations so that EvalAddTree adds less error than summing each
     //iteration
     Ctxt masked = mask_mod_n(vectors[vectors.size() - 1], 128);
-    if (vectors.size() > 1) masked = rotate(masked, -1);
+    if (vectors.size() > 1) rotate_inplace(masked, -1);
 
     for (int i = vectors.size() - 2; i >= 0; i--) {
-        masked = add(masked, mask_mod_n(vectors[i], 128));
+        add_inplace(masked, mask_mod_n(vectors[i], 128));
         if (i > 0) {
-            masked = rotate(masked, -1);
+            rotate_inplace(masked, -1);
         }
     }
 
@@ -1075,56 +1503,56 @@ Ctxt FHEController::wrapUpExpanded(vector<Ctxt> vectors) {
 }
 
 vector<Ctxt> FHEController::unwrapExpanded(Ctxt c, int inputs_num) {
-    vector<Ctxt> result;
-
-    for (int i = 0; i < inputs_num; i++) {
-        Ctxt out = mask_mod_n(c, 128, 0,inputs_num * 128);
-        out = repeat(out, 128);
-
+    //The shifts are chained (only the rotation by 1 is available), the extraction of each input is independent
+    vector<Ctxt> shifted = {c};
+    for (int i = 1; i < inputs_num; i++) {
+        shifted.push_back(rotate(shifted[i - 1], 1));
+    }
 
-        if (i < inputs_num - 1) c = rotate(c, 1);
+    vector<Ctxt> result(inputs_num);
 
-        result.push_back(out);
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (int i = 0; i < inputs_num; i++) {
+        omp_set_num_threads(inner);
+        result[i] = repeat(mask_mod_n(shifted[i], 128, 0,inputs_num * 128), 128);
     }
 
     return result;
 }
 
-vector<vector<Ctxt>> FHEController::unwrapRepeatedLarge(vector<Ctxt> containers, int input_number) {
-    vector<vector<Ctxt>> unwrapped_output;
-    vector<int> quantities;
-
-    for (int i = 0; i < input_number / 32.0; i++) {
-        int quantity = 32;
-        if ((i + 1) * 32 > input_number) {
-            quantity = input_number - (i * 32);
-        }
+vector<vector<Ctxt>> FHEController::unwrapRepeatedLarge(const vector<Ctxt> &containers, int input_number) {
+    vector<vector<Ctxt>> unwrapped_output(input_number);
 
-        quantities.push_back(quantity);
-    }
-
-    for (int i = 0; i < containers.size(); i++) {
-        for (int j = 0; j < quantities[i]; j++) {
-            vector<Ctxt> unwrapped_container = unwrap_512_in_4_128(containers[i], j);
-            unwrapped_output.push_back(unwrapped_container);
-        }
+    //Each container holds up to 32 inputs of 512 slots: input k is the (k % 32)-th block of container k / 32
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (int k = 0; k < input_number; k++) {
+        omp_set_num_threads(inner);
+        unwrapped_output[k] = unwrap_512_in_4_128(containers[k / 32], k % 32);
     }
 
     return unwrapped_output;
 }
 
 vector<Ctxt> FHEController::unwrapScoresExpanded(Ctxt c, int inputs_num) {
-    vector<Ctxt> result;
+    vector<Ctxt> shifted = {c};
+    for (int i = 1; i < inputs_num; i++) {
+        shifted.push_back(rotate(shifted[i - 1], 1));
+    }
 
-    for (int i = 0; i < inputs_num; i++) {
-        Ctxt i_th_1 = mask_mod_n(c, 128, 0,inputs_num * 128);
-        Ctxt i_th_2 = mask_mod_n(c, 128, 64, inputs_num * 128);
-        i_th_1 = repeat(i_th_1, 64);
-        i_th_2 = repeat(i_th_2, 64);
+    vector<Ctxt> result(inputs_num);
 
-        if (i < inputs_num - 1) c = rotate(c, 1);
+    //Both heads of the same input are unwrapped together, the inputs by the ciphertext workers
+    int inner = nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(ciphertext_workers) if(ciphertext_workers > 1)
+    for (int i = 0; i < inputs_num; i++) {
+        omp_set_num_threads(inner);
+        Ctxt i_th_1 = repeat(mask_mod_n(shifted[i], 128, 0, inputs_num * 128), 64);
+        Ctxt i_th_2 = repeat(mask_mod_n(shifted[i], 128, 64, inputs_num * 128), 64);
 
-        result.push_back(add(i_th_1, i_th_2));
+        add_inplace(i_th_1, i_th_2);
+        result[i] = std::move(i_th_1);
     }
 
     return result;
@@ -1144,15 +1572,15 @@ vector<Ctxt> FHEController::unwrap_512_in_4_128(const Ctxt &c, int index) {
     Ctxt score4 = mask_block(c, shift + 384, shift + 512, 1);
     score4 = repeat(score4, 128, -128);
 
-    result.push_back(score1);
-    result.push_back(score2);
-    result.push_back(score3);
-    result.push_back(score4);
+    result.push_back(std::move(score1));
+    result.push_back(std::move(score2));
+    result.push_back(std::move(score3));
+    result.push_back(std::move(score4));
 
     return result;
 }
 
-vector<Ctxt> FHEController::generate_containers(vector<Ctxt> inputs, const Ctxt& bias) {
+vector<Ctxt> FHEController::generate_containers(const vector<Ctxt> &inputs, const Ctxt& bias) {
     vector<Ctxt> containers;
     vector<int> quantities;
 
@@ -1172,23 +1600,25 @@ vector<Ctxt> FHEController::generate_containers(vector<Ctxt> inputs, const Ctxt&
 
         Ctxt partial_container = wrap_containers( sliced_input, quantity);
 
+        //wrap_containers returns the input itself when quantity == 1, so no in-place add here
         if (bias != 0) partial_container = add(partial_container, bias);
 
-        containers.push_back(partial_container);
+        containers.push_back(std::move(partial_container));
     }
 
     return containers;
 }
 
-Ctxt FHEController::wrap_containers(vector<Ctxt> c, int inputs_number) {
+Ctxt FHEController::wrap_containers(const vector<Ctxt> &c, int inputs_number) {
     //Resulting Ctxt will contain all the ciphertexts as follows:
     //c_n | c_n-1 | c_n-2 | ... | c_0
 
     Ctxt result = c[0];
 
     for (int i = 1; i < inputs_number; i++) {
+        //rotate() returns a fresh ciphertext, so c[0] is never modified by add_inplace
         result = rotate(result, -512);
-        result = add(result, c[i]);
+        add_inplace(result, c[i]);
     }
 
     return result;
@@ -1287,14 +1717,111 @@ Ctxt FHEController::eval_exp(const Ctxt &c, int inputs_number) {
     return add(res, encoded);
 }
 
-Ctxt FHEController::eval_inverse(const Ctxt &c, double min, double max) {
-    double middle = (max - min) / 2; //9995
+Ctxt FHEController::softmax(const Ctxt &scores, int inputs_number, double min_sum, double max_sum,
+                           int inverse_degree, int inverse_iterations) {
+    //exp(x) = (e^(r * x))^(1/r): Taylor polynomial of degree 6 followed by log2(1/r) squarings
+    int squarings = static_cast<int>(round(log2(1 / softmax_r)));
+    int exp_depth = 3 + squarings;
+    int normalization_depth = inverse_depth(inverse_degree, inverse_iterations) + 1;
+
+    //The exponentials are computed divided by max_sum, so every value (and every sum) is in [0, 1] and can be
+    //bootstrapped between the exp and the normalization. The factor cancels out in the division.
+    //It is folded in the Taylor coefficients: (c * p(x))^(2^s) = p(x)^(2^s) / max_sum
+    double c = pow(max_sum, -1.0 / pow(2, squarings));
+
+    //Bootstraps are planned once: the input (|x| <= 1) only if the exp does not fit, the exponentials only if
+    //the normalization does not fit after them
+    Ctxt res = scores;
+    if (remaining_levels(res) < exp_depth) {
+        res = bootstrap(res);
+    }
+
+    vector<double> coefficients = {1, 1, 1/(2.0), 1/(6.0), 1/(24.0), 1/(120.0), 1/(720.0)};
+    for (double &coefficient : coefficients) coefficient *= c;
+
+    res = context->EvalPoly(res, coefficients);
+
+    for (int i = 0; i < squarings; i++) {
+        res = context->EvalSquare(res);
+    }
+
+    if (remaining_levels(res) < normalization_depth) {
+        res = bootstrap(res);
+    }
+
+    //Padding slots were 0 and are now 1 / max_sum: they are cleared with the real token count
+    vector<double> mask(num_slots);
+    for (int i = 0; i < num_slots; i++) {
+        if (i % 64 < inputs_number && i < (128 * inputs_number)) {
+            mask[i] = 0;
+        } else {
+            mask[i] = -1 / max_sum;
+        }
+    }
+    add_inplace(res, encode(mask, res->GetLevel(), num_slots));
+
+    Ctxt sum = rotsum(res, 128, 128);
+    Ctxt inverse = eval_inverse(sum, min_sum / max_sum, 1, inverse_degree, inverse_iterations);
+
+    return mult(res, inverse);
+}
+
+Ctxt FHEController::eval_inverse(const Ctxt &c, double min, double max, int seed_degree, int iterations, InverseMethod method) {
+    //The Chebyshev interpolant of 1/x has a relative error below 1 on the whole interval even at low degrees,
+    //so both refinements converge quadratically from it
+    Ctxt y = context->EvalChebyshevFunction([](double x) -> double { return 1 / x; }, c, min, max, seed_degree);
+
+    if (iterations == 0) return y;
+
+    //-x is ready long before y, so the sign costs no depth
+    Ctxt minus_x = mult(c, -1);
+
+    if (method == InverseMethod::NEWTON) {
+        for (int i = 0; i < iterations; i++) {
+            Ctxt correction = mult(minus_x, y);
+            add_inplace(correction, 2);
+            y = mult(y, correction);
+        }
+
+        return y;
+    }
+
+    //Goldschmidt: e = 1 - x * y0, 1/x = y0 * (1 + e) * (1 + e^2) * (1 + e^4) ..., e^(2^k) and the product are
+    //computed side by side
+    Ctxt e = mult(minus_x, y);
+    add_inplace(e, 1);
+
+    for (int i = 0; i < iterations; i++) {
+        //e is squared afterwards: 1 + e goes on a copy, the constant is added to the scalar part (no encoding)
+        Ctxt factor = e->Clone();
+        add_inplace(factor, 1.0);
+        y = mult(y, factor);
+
+        if (i < iterations - 1) e = context->EvalSquare(e);
+    }
+
+    return y;
+}
+
+int FHEController::inverse_depth(int seed_degree, int iterations, InverseMethod method) {
+    if (iterations == 0) return get_relu_depth(seed_degree);
+
+    if (method == InverseMethod::NEWTON) return get_relu_depth(seed_degree) + 2 * iterations;
+
+    return get_relu_depth(seed_degree) + 1 + iterations;
+}
+
+double FHEController::inverse_precision(double min, double max, int seed_degree, int iterations) {
+    vector<double> coefficients = chebyshev_coefficients([](double x) -> double { return 1 / x; }, min, max, seed_degree);
 
-    Ptxt enc_x =  encode(-middle - min, c->GetLevel(), num_slots);
-    Ctxt res = add(c, enc_x); // lo centro
-    res = mult(res, encode(1 / middle, res->GetLevel(), num_slots)); //basta prima mascherare con 1 /9995 e addare -10005/9995 dopopì
+    //Maximum relative error of the seed on a log-spaced grid (the error is largest close to min)
+    double seed_error = 0;
+    for (int k = 0; k <= 2000; k++) {
+        double x = min * pow(max / min, k / 2000.0);
+        seed_error = std::max(seed_error, abs(1 - x * chebyshev_evaluate(coefficients, min, max, x)));
+    }
 
-    return context->EvalChebyshevFunction([](double x) -> double { return 1 / ((x * 9895) + 9995); }, res, -1, 1, 200);
+    return pow(seed_error, pow(2, iterations));
 }
 
 Ctxt FHEController::eval_inverse_naive(const Ctxt &c, double min, double max) {
@@ -1310,10 +1837,101 @@ Ctxt FHEController::eval_gelu_function(const Ctxt &c, double min, double max, do
 }
 
 Ctxt FHEController::eval_tanh_function(const Ctxt &c, double min, double max, double mult, int degree) {
+    if (tanh_odd && min == -max) {
+        return eval_odd_function([mult](double x) -> double { return tanh(x * (1 / mult)); }, c, max, degree);
+    }
+
     return context->EvalChebyshevFunction([mult](double x) -> double { return tanh(x * (1 / mult)); }, c, min, max, degree);
 }
 
-vector<Ctxt> FHEController::slicing(vector<Ctxt> &arr, int X, int Y) {
+Ctxt FHEController::eval_odd_function(const function<double(double)> &f, const Ctxt &c, double bound, int degree) {
+    //The interpolant p of an odd f on [-bound, bound] is odd, so p(x) / x is a polynomial g of degree (degree - 1) / 2
+    //in y = x^2: interpolating g on [0, bound^2] at that degree reproduces p exactly
+    vector<double> coefficients = chebyshev_coefficients(f, -bound, bound, degree);
+    auto g = [coefficients, bound](double y) -> double {
+        double x = sqrt(y);
+        return chebyshev_evaluate(coefficients, -bound, bound, x) / x;
+    };
+
+    Ctxt square = context->EvalSquare(c);
+    Ctxt res = context->EvalChebyshevFunction(g, square, 0, bound * bound, (degree - 1) / 2);
+
+    return mult(c, res);
+}
+
+Ctxt FHEController::eval_even_function(const function<double(double)> &f, const Ctxt &c, double bound, int degree) {
+    vector<double> coefficients = chebyshev_coefficients(f, -bound, bound, degree);
+    auto h = [coefficients, bound](double y) -> double {
+        return chebyshev_evaluate(coefficients, -bound, bound, sqrt(y));
+    };
+
+    return context->EvalChebyshevFunction(h, context->EvalSquare(c), 0, bound * bound, degree / 2);
+}
+
+int FHEController::inverse_sqrt_depth(int seed_degree, int newton_steps) {
+    //Newton step: y^2, (-scale/2 * x) * y^2, y * (1.5 + ...)
+    return get_relu_depth(seed_degree) + 3 * newton_steps;
+}
+
+Ctxt FHEController::eval_inverse_sqrt(const Ctxt &c, double min, double max, double scale, int seed_degree, int newton_steps) {
+    Ctxt y = context->EvalChebyshevFunction([scale](double x) -> double { return 1 / sqrt(scale * x); }, c, min, max, seed_degree);
+
+    if (newton_steps == 0) return y;
+
+    //y <- y * (1.5 - 0.5 * scale * x * y^2), the error goes from e to ~1.5 e^2
+    Ctxt half_x = mult(c, -0.5 * scale);
+
+    for (int i = 0; i < newton_steps; i++) {
+        Ctxt correction = mult(half_x, context->EvalSquare(y));
+        add_inplace(correction, 1.5);
+        y = mult(y, correction);
+    }
+
+    return y;
+}
+
+template <typename T>
+Ctxt FHEController::layernorm_impl(const Ctxt &c, int inputs_number, const T &gamma, const T &beta,
+                                   double var_min, double var_max, int seed_degree, int newton_steps) {
+    //Sums over the 128 features of a token are a rotsum over the 128-slot blocks, the result is repeated in
+    //every block, so it is already aligned with the token
+    Ctxt mean = mult(rotsum(c, 128, 128), 1 / 128.0);
+    Ctxt centered = sub(c, mean);
+
+    //Variance normalized to (0, 1] by var_max, so it can be bootstrapped if the inverse square root does not fit
+    Ctxt variance = mult(rotsum(context->EvalSquare(centered), 128, 128), 1 / (128.0 * var_max));
+
+    //Padding tokens have variance 0: they get var_max, the result there is just beta
+    vector<double> padding(num_slots, 0);
+    for (int i = 0; i < num_slots; i++) {
+        if (i % 128 >= inputs_number) padding[i] = 1;
+    }
+    add_inplace(variance, encode(padding, variance->GetLevel(), num_slots));
+
+    if (remaining_levels(variance) < inverse_sqrt_depth(seed_degree, newton_steps) + 1) {
+        variance = bootstrap(variance);
+    }
+
+    Ctxt inverse_std = eval_inverse_sqrt(variance, var_min / var_max, 1, var_max, seed_degree, newton_steps);
+
+    //gamma multiplies the centered values while the inverse square root is being computed, so it costs no depth
+    Ctxt output = mult(mult(centered, gamma), inverse_std);
+    add_inplace(output, beta);
+
+    return output;
+}
+
+Ctxt FHEController::layernorm(const Ctxt &c, int inputs_number, const Ctxt &gamma, const Ctxt &beta,
+                              double var_min, double var_max, int seed_degree, int newton_steps) {
+    return layernorm_impl(c, inputs_number, gamma, beta, var_min, var_max, seed_degree, newton_steps);
+}
+
+Ctxt FHEController::layernorm(const Ctxt &c, int inputs_number, const Ptxt &gamma, const Ptxt &beta,
+                              double var_min, double var_max, int seed_degree, int newton_steps) {
+    return layernorm_impl(c, inputs_number, gamma, beta, var_min, var_max, seed_degree, newton_steps);
+}
+
+vector<Ctxt> FHEController::slicing(const vector<Ctxt> &arr, int X, int Y) {
     if (Y - X >= arr.size())
         return arr;
 
@@ -1335,19 +1953,23 @@ vector<Ctxt> FHEController::slicing(vector<Ctxt> &arr, int X, int Y) {
 }
 
 
-void FHEController::save(Ctxt v, std::string filename) {
+void FHEController::save(const Ctxt &v, const string &filename) {
     Serial::SerializeToFile(filename, v,
                             SerType::BINARY);
 }
 
-void FHEController::save(vector<Ctxt> v, std::string filename) {
+void FHEController::save(const vector<Ctxt> &v, const string &filename) {
     Serial::SerializeToFile(filename, v,
                             SerType::BINARY);
 }
 
-vector<Ctxt> FHEController::load_vector(string filename) {
+vector<Ctxt> FHEController::load_vector(const string &filename) {
     vector<Ctxt> result;
 
+    if (raw_file(filename)) {
+        return load_raw(filename);
+    }
+
     if (!Serial::DeserializeFromFile(filename, result,
                                      SerType::BINARY)) {
         cerr << "Could not find \"" << filename << "\""
@@ -1358,9 +1980,18 @@ vector<Ctxt> FHEController::load_vector(string filename) {
     return result;
 }
 
-Ctxt FHEController::load_ciphertext(string filename) {
+Ctxt FHEController::load_ciphertext(const string &filename) {
     Ctxt result;
 
+    if (raw_file(filename)) {
+        vector<Ctxt> loaded = load_raw(filename);
+        if (loaded.size() != 1) {
+            cerr << "\"" << filename << "\" holds " << loaded.size() << " ciphertexts, expected one" << endl;
+            exit(1);
+        }
+        return loaded[0];
+    }
+
     if (!Serial::DeserializeFromFile(filename, result,
                                      SerType::BINARY)) {
         cerr << "Could not find \"" << filename << "\""
@@ -1371,14 +2002,283 @@ Ctxt FHEController::load_ciphertext(string filename) {
     return result;
 }
 
+/*
+ * Raw ciphertext format (native byte order, the machines writing and reading are the same kind):
+ *   file   = RawFileHeader, count x ciphertext
+ *   ctxt   = RawCiphertextHeader, key tag, towers x uint64 modulus, elements x towers x ring_dim uint64
+ * Towers are kept in the format they have in memory (evaluation/NTT), so saving and loading is a copy
+ * of the coefficients: no cereal archive, no per-tower allocations, the file is read through mmap.
+ *
+ * Seeded files (SEED_MAGIC) hold secret-key ciphertexts: ctxt = 32-byte seed, then the raw layout with
+ * the b element only. a is expanded from the seed on load, see expand_seed.
+ */
+static const char RAW_MAGIC[8] = {'F', 'H', 'E', 'R', 'A', 'W', '0', '1'};
+static const char SEED_MAGIC[8] = {'F', 'H', 'E', 'S', 'E', 'E', 'D', '1'};
+
+struct RawFileHeader {
+    char magic[8];
+    uint64_t count;
+};
+
+struct RawCiphertextHeader {
+    uint32_t elements;
+    uint32_t towers;
+    uint32_t ring_dim;
+    uint32_t slots;
+    uint64_t level;
+    uint64_t noise_scale_deg;
+    double scaling_factor;
+    int32_t format;
+    uint32_t key_tag_size;
+};
+
+static bool raw_file(const string &filename) {
+    ifstream in(filename, ios::binary);
+    char magic[8];
+    return in.read(magic, sizeof(magic)) &&
+           (memcmp(magic, RAW_MAGIC, sizeof(magic)) == 0 || memcmp(magic, SEED_MAGIC, sizeof(magic)) == 0);
+}
+
+void FHEController::save_raw(const Ctxt &v, const string &filename) {
+    save_raw(vector<Ctxt>{v}, filename);
+}
+
+void FHEController::save_raw(const vector<Ctxt> &v, const string &filename) {
+    FILE *out = fopen(filename.c_str(), "wb");
+    if (out == nullptr) {
+        cerr << "Cannot write \"" << filename << "\"" << endl;
+        exit(1);
+    }
+
+    RawFileHeader header;
+    memcpy(header.magic, RAW_MAGIC, sizeof(RAW_MAGIC));
+    header.count = v.size();
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (const Ctxt &c : v) {
+        write_raw(out, c);
+    }
+
+    if (fclose(out) != 0) {
+        cerr << "Error writing \"" << filename << "\"" << endl;
+        exit(1);
+    }
+}
+
+void FHEController::save_seeded(const SeededCtxt &v, const string &filename) {
+    save_seeded(vector<SeededCtxt>{v}, filename);
+}
+
+void FHEController::save_seeded(const vector<SeededCtxt> &v, const string &filename) {
+    FILE *out = fopen(filename.c_str(), "wb");
+    if (out == nullptr) {
+        cerr << "Cannot write \"" << filename << "\"" << endl;
+        exit(1);
+    }
+
+    RawFileHeader header;
+    memcpy(header.magic, SEED_MAGIC, sizeof(SEED_MAGIC));
+    header.count = v.size();
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (const SeededCtxt &c : v) {
+        fwrite(c.seed.data(), 1, c.seed.size(), out);
+        write_raw(out, c.c, 1);
+    }
+
+    if (fclose(out) != 0) {
+        cerr << "Error writing \"" << filename << "\"" << endl;
+        exit(1);
+    }
+}
+
+// elements_count: how many of the ciphertext elements are written, 0 = all
+void FHEController::write_raw(FILE *out, const Ctxt &c, size_t elements_count) {
+    const vector<DCRTPoly> &elements = c->GetElements();
+    string key_tag = c->GetKeyTag();
+
+    RawCiphertextHeader header;
+    header.elements = elements_count > 0 ? elements_count : elements.size();
+    header.towers = elements[0].GetNumOfElements();
+    header.ring_dim = elements[0].GetRingDimension();
+    header.slots = c->GetSlots();
+    header.level = c->GetLevel();
+    header.noise_scale_deg = c->GetNoiseScaleDeg();
+    header.scaling_factor = c->GetScalingFactor();
+    header.format = elements[0].GetFormat();
+    header.key_tag_size = key_tag.size();
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(key_tag.data(), 1, key_tag.size(), out);
+
+    for (uint32_t t = 0; t < header.towers; t++) {
+        uint64_t modulus = elements[0].GetElementAtIndex(t).GetModulus().ConvertToInt();
+        fwrite(&modulus, sizeof(modulus), 1, out);
+    }
+
+    vector<uint64_t> buffer(header.ring_dim);
+    for (uint32_t e = 0; e < header.elements; e++) {
+        for (uint32_t t = 0; t < header.towers; t++) {
+            const auto &tower = elements[e].GetElementAtIndex(t);
+            for (uint32_t j = 0; j < header.ring_dim; j++) {
+                buffer[j] = tower[j].ConvertToInt();
+            }
+            fwrite(buffer.data(), sizeof(uint64_t), header.ring_dim, out);
+        }
+    }
+}
+
+vector<Ctxt> FHEController::load_raw(const string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Could not find \"" << filename << "\"" << endl;
+        exit(1);
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "Cannot map \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char *cursor = static_cast<const char *>(mapped);
+    const char *end = cursor + size;
+
+    RawFileHeader header;
+    if (size < sizeof(header)) {
+        cerr << "Truncated raw ciphertext file \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    memcpy(&header, cursor, sizeof(header));
+    cursor += sizeof(header);
+    bool seeded = memcmp(header.magic, SEED_MAGIC, sizeof(SEED_MAGIC)) == 0;
+
+    vector<Ctxt> result;
+    for (uint64_t i = 0; i < header.count; i++) {
+        result.push_back(seeded ? read_seeded(cursor, end, filename) : read_raw(cursor, end, filename));
+    }
+
+    munmap(mapped, size);
+
+    return result;
+}
+
+Ctxt FHEController::read_raw(const char *&cursor, const char *end, const string &filename) {
+    RawCiphertextHeader header;
+    if (cursor + sizeof(header) > end) {
+        cerr << "Truncated raw ciphertext file \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    memcpy(&header, cursor, sizeof(header));
+    cursor += sizeof(header);
+
+    size_t payload = header.key_tag_size + header.towers * sizeof(uint64_t) +
+                     (size_t) header.elements * header.towers * header.ring_dim * sizeof(uint64_t);
+    if (cursor + payload > end) {
+        cerr << "Truncated raw ciphertext file \"" << filename << "\"" << endl;
+        exit(1);
+    }
+
+    string key_tag(cursor, header.key_tag_size);
+    cursor += header.key_tag_size;
+
+    const uint64_t *moduli = reinterpret_cast<const uint64_t *>(cursor);
+    cursor += header.towers * sizeof(uint64_t);
+
+    // Full-depth zero polynomial of this context, reduced to the towers of the saved ciphertext
+    DCRTPoly zero(context->GetElementParams(), Format::EVALUATION, true);
+    if (zero.GetRingDimension() != header.ring_dim || zero.GetNumOfElements() < header.towers) {
+        cerr << "\"" << filename << "\" was written with different crypto parameters" << endl;
+        exit(1);
+    }
+    zero.DropLastElements(zero.GetNumOfElements() - header.towers);
+    zero.SetFormat(static_cast<Format>(header.format));
+
+    for (uint32_t t = 0; t < header.towers; t++) {
+        if (zero.GetElementAtIndex(t).GetModulus().ConvertToInt() != moduli[t]) {
+            cerr << "\"" << filename << "\" was written with different crypto parameters" << endl;
+            exit(1);
+        }
+    }
+
+    vector<DCRTPoly> elements(header.elements, zero);
+    for (DCRTPoly &element : elements) {
+        for (uint32_t t = 0; t < header.towers; t++) {
+            auto &tower = element.GetAllElements()[t];
+            const uint64_t *values = reinterpret_cast<const uint64_t *>(cursor);
+            for (uint32_t j = 0; j < header.ring_dim; j++) {
+                tower[j] = values[j];
+            }
+            cursor += header.ring_dim * sizeof(uint64_t);
+        }
+    }
+
+    Ctxt c = make_shared<CiphertextImpl<DCRTPoly>>(context);
+    c->SetElements(std::move(elements));
+    c->SetEncodingType(CKKS_PACKED_ENCODING);
+    c->SetKeyTag(key_tag);
+    c->SetLevel(header.level);
+    c->SetNoiseScaleDeg(header.noise_scale_deg);
+    c->SetScalingFactor(header.scaling_factor);
+    c->SetSlots(header.slots);
+
+    return c;
+}
+
+Ctxt FHEController::read_seeded(const char *&cursor, const char *end, const string &filename) {
+    array<uint8_t, 32> seed;
+    if (cursor + seed.size() > end) {
+        cerr << "Truncated seeded ciphertext file \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    memcpy(seed.data(), cursor, seed.size());
+    cursor += seed.size();
+
+    Ctxt c = read_raw(cursor, end, filename);
+
+    vector<DCRTPoly> elements = c->GetElements();
+    if (elements.size() != 1 || elements[0].GetFormat() != Format::EVALUATION) {
+        cerr << "\"" << filename << "\" is not a seeded ciphertext" << endl;
+        exit(1);
+    }
+    elements.push_back(expand_seed(seed, elements[0].GetParams()));
+    c->SetElements(std::move(elements));
+
+    return c;
+}
+
+// a of a seeded ciphertext: tower t is ChaCha20(seed, nonce t) reduced to uniform values mod q_t,
+// directly in evaluation form (the NTT is a bijection, so a is uniform either way)
+DCRTPoly FHEController::expand_seed(const array<uint8_t, 32> &seed, const shared_ptr<DCRTPoly::Params> &params) {
+    DCRTPoly a(params, Format::EVALUATION, true);
+
+    #pragma omp parallel for
+    for (size_t t = 0; t < a.GetNumOfElements(); t++) {
+        auto &tower = a.GetAllElements()[t];
+        uint64_t modulus = tower.GetModulus().ConvertToInt();
+
+        ChaCha20 prg(seed.data(), t);
+        for (uint32_t j = 0; j < a.GetRingDimension(); j++) {
+            tower[j] = prg.uniform(modulus);
+        }
+    }
+
+    return a;
+}
 
 Ctxt FHEController::load_encrypted_expand(
     string filename,
     int num_inputs)
 {
     const int base_size = 128;
-    Ctxt encryptedInput = load_ciphertext(filename);
-    Ctxt result = encryptedInput->Clone();
+    // Seeded uploads (save_seeded) get their a component regenerated here
+    Ctxt result = load_ciphertext(filename);
 
     // Обнуление "лишних" позиций (маска только для нужных слотов)
     std::vector<double> mask(base_size * base_size, 0.0);
@@ -1389,7 +2289,7 @@ Ctxt FHEController::load_encrypted_expand(
     }
 
     auto maskPtxt = context->MakeCKKSPackedPlaintext(mask);
-    result = mult(result, maskPtxt);
+    mult_inplace(result, maskPtxt);
 
     return result;
 }
@@ -1431,12 +2331,22 @@ Ctxt FHEController::load_encrypted_expand(
 // depth chebyshev_degree(14-27) ~= 6
 // depth chebyshev_degree(200) ~= 9
 Ctxt FHEController::eval_sign_function(const Ctxt &c, double min, double max, int degree) {
+    auto minus_sign = [](double x) -> double {
+        if (x > 0.0) return -1.0;
+        else if (x < 0.0) return 1.0;
+        else return 0.0;
+    };
+
+    if (sign_backend == SignBackend::COMPOSITE && min == -max) {
+        return eval_composite_sign(c, max, sign_margin, sign_precision);
+    }
+
+    if (sign_odd && min == -max) {
+        return eval_odd_function(minus_sign, c, max, degree);
+    }
+
     return context->EvalChebyshevFunction(
-        [](double x) -> double {
-            if (x > 0.0) return -1.0;
-            else if (x < 0.0) return 1.0;
-            else return 0.0;
-        },
+        minus_sign,
         c,
         min,
         max,
@@ -1444,6 +2354,142 @@ Ctxt FHEController::eval_sign_function(const Ctxt &c, double min, double max, in
     );
 }
 
+/*
+ * Composite sign. f_n(x) = sum_{i=0}^{n} C(2i, i) / 4^i * x * (1 - x^2)^i is flat close to +-1, g_n (minimax
+ * coefficients from Cheon, Kim, Kim - "Efficient Homomorphic Comparison Methods with Optimal Complexity")
+ * pushes small values away from 0 quickly. Both map [-1, 1] in [-1, 1], so every stage can be bootstrapped.
+ */
+static const vector<vector<double>> SIGN_G_COEFFICIENTS = {
+    {0, 2126 / 1024.0, 0, -1359 / 1024.0},
+    {0, 3334 / 1024.0, 0, -6108 / 1024.0, 0, 3796 / 1024.0},
+    {0, 4589 / 1024.0, 0, -16577 / 1024.0, 0, 25614 / 1024.0, 0, -12860 / 1024.0},
+    {0, 5850 / 1024.0, 0, -34974 / 1024.0, 0, 97015 / 1024.0, 0, -113492 / 1024.0, 0, 46623 / 1024.0}
+};
+
+static vector<double> sign_f_coefficients(int n) {
+    vector<double> coefficients(2 * n + 2, 0);
+
+    double weight = 1; // C(2i, i) / 4^i
+    for (int i = 0; i <= n; i++) {
+        if (i > 0) weight *= (2.0 * i - 1) / (2.0 * i);
+
+        //x * (1 - x^2)^i = sum_k C(i, k) (-1)^k x^(2k + 1)
+        double binomial = 1;
+        for (int k = 0; k <= i; k++) {
+            if (k > 0) binomial *= (i - k + 1) / static_cast<double>(k);
+            coefficients[2 * k + 1] += weight * binomial * (k % 2 == 0 ? 1 : -1);
+        }
+    }
+
+    return coefficients;
+}
+
+static double evaluate_polynomial(const vector<double> &coefficients, double x) {
+    double res = 0;
+    for (int i = coefficients.size() - 1; i >= 0; i--) res = res * x + coefficients[i];
+    return res;
+}
+
+SignSchedule FHEController::composite_sign_schedule(double epsilon, int precision_bits) {
+    double target = pow(2, -precision_bits);
+
+    //Worst case on a log-spaced grid of [epsilon, 1] (the polynomials are odd)
+    vector<double> grid;
+    for (int k = 0; k <= 2000; k++) grid.push_back(epsilon * pow(1 / epsilon, k / 2000.0));
+
+    SignSchedule best = {0, 0, 0, INT32_MAX, 1};
+
+    for (int family = 1; family <= 4; family++) {
+        vector<double> f = sign_f_coefficients(family);
+        const vector<double> &g = SIGN_G_COEFFICIENTS[family - 1];
+        int stage_depth = static_cast<int>(ceil(log2(2 * family + 2)));
+
+        for (int g_count = 0; g_count <= 12; g_count++) {
+            for (int f_count = (g_count == 0 ? 1 : 0); f_count <= 6; f_count++) {
+                int depth = (g_count + f_count) * stage_depth;
+                if (depth >= best.depth) break;
+
+                double error = 0;
+                for (double x : grid) {
+                    double y = x;
+                    for (int i = 0; i < g_count; i++) y = evaluate_polynomial(g, y);
+                    for (int i = 0; i < f_count; i++) y = evaluate_polynomial(f, y);
+                    error = max(error, abs(1 - y));
+                }
+
+                if (error <= target) {
+                    best = {family, g_count, f_count, depth, error};
+                    break;
+                }
+            }
+        }
+    }
+
+    if (best.family == 0) {
+        cerr << "No composite sign schedule reaches 2^-" << precision_bits << " with margin " << epsilon << endl;
+        exit(1);
+    }
+
+    return best;
+}
+
+void FHEController::print_composite_sign_table() {
+    cout << "margin (of bound) | precision | family | g x f | depth | worst error" << endl;
+
+    for (int log_epsilon : {3, 5, 8, 10}) {
+        for (int precision : {4, 8, 12}) {
+            SignSchedule s = composite_sign_schedule(pow(2, -log_epsilon), precision);
+            cout << "2^-" << setw(2) << log_epsilon << "             | 2^-" << setw(2) << precision
+                 << "     | n = " << s.family << "  | " << setw(2) << s.g_count << " x " << s.f_count
+                 << " | " << setw(5) << s.depth << " | " << s.error << endl;
+        }
+    }
+}
+
+Ctxt FHEController::eval_composite_sign(const Ctxt &c, double bound, double margin, int precision_bits) {
+    SignSchedule schedule = composite_sign_schedule(margin / bound, precision_bits);
+    int stage_depth = static_cast<int>(ceil(log2(2 * schedule.family + 2)));
+    int stages = schedule.g_count + schedule.f_count;
+
+    Ctxt res = c;
+
+    for (int stage = 0; stage < stages; stage++) {
+        vector<double> coefficients = stage < schedule.g_count ? SIGN_G_COEFFICIENTS[schedule.family - 1]
+                                                               : sign_f_coefficients(schedule.family);
+
+        //x / bound is folded in the first polynomial, the sign convention (-1 for x > 0) in the last one
+        if (stage == 0) {
+            for (size_t i = 0; i < coefficients.size(); i++) coefficients[i] /= pow(bound, i);
+        }
+        if (stage == stages - 1) {
+            for (double &coefficient : coefficients) coefficient = -coefficient;
+        }
+
+        //After the first stage the values are in [-1, 1]
+        if (remaining_levels(res) < stage_depth) {
+            if (stage == 0 && bound > 1) {
+                res = mult(res, 1 / bound);
+                for (size_t i = 0; i < coefficients.size(); i++) coefficients[i] *= pow(bound, i);
+            }
+            res = bootstrap(res);
+        }
+
+        res = context->EvalPoly(res, coefficients);
+    }
+
+    return res;
+}
+
+int FHEController::sign_depth(double min, double max, int degree) {
+    if (sign_backend == SignBackend::COMPOSITE && min == -max) {
+        return composite_sign_schedule(sign_margin / max, sign_precision).depth;
+    }
+
+    if (sign_odd && min == -max) return chebyshev_depth((degree - 1) / 2) + 2;
+
+    return chebyshev_depth(degree);
+}
+
 // sign_difference: возвращает if x > y: -1, if x < y: 1
 // {0.8, 0.3},    // x > y → -1 NEG
 // {0.2, 0.5},    // x < y → 1 POS
@@ -1453,7 +2499,7 @@ Ctxt FHEController::eval_sign_function(const Ctxt &c, double min, double max, in
 Ctxt FHEController::sign_difference(const Ctxt &x, const Ctxt &y,
         double min, double max, int d) {
     // abs here for diff
-    Ctxt diff = add(x, mult(y, -1));
+    Ctxt diff = sub(x, y);
     Ctxt result = eval_sign_function(diff, min, max, d);
     return result;
 }
@@ -1513,13 +2559,21 @@ Ctxt FHEController::sign_difference(const Ctxt &x, const Ctxt &y,
 
 Ctxt FHEController::accuracy(const Ctxt &x_neg, const Ctxt &x_pos, const vector<double> &y,
                              double min, double max, int d) {
+    if (sign_backend == SignBackend::SCHEME_SWITCH) {
+        Ctxt less = compare_scheme_switching(x_neg, x_pos, y.size());
+        return accuracy_from_comparison(less, encode(y, less->GetLevel(), num_slots));
+    }
+
     Ctxt diff = context->EvalSub(x_neg, x_pos);
-    diff = bootstrap(diff);
+    //The composite backend bootstraps between its stages by itself (on values in [-1, 1])
+    int needed = sign_backend == SignBackend::COMPOSITE ? 1 : sign_depth(min, max, d);
+    if (remaining_levels(diff) < needed) diff = bootstrap(diff);
 
     Ctxt pred_label = eval_sign_function(diff, min, max, d);
-    pred_label = bootstrap(pred_label);
+    if (remaining_levels(pred_label) < 2) pred_label = bootstrap(pred_label); // labels product + 0.5
 
-    Ptxt p_labels = encode(y, pred_label->GetLevel(), y.size());
+    // Zero-padded to the ciphertext: any n up to num_slots, padding slots end up at 0.5
+    Ptxt p_labels = encode(y, pred_label->GetLevel(), num_slots);
     // match = (pred_label * true_label + 1) * 1/2
     Ctxt match = context->EvalMult(pred_label, p_labels); // pred_label * true_label
     match = context->EvalAdd(match, 1.0);             // +1
@@ -1530,11 +2584,17 @@ Ctxt FHEController::accuracy(const Ctxt &x_neg, const Ctxt &x_pos, const vector<
 
 Ctxt FHEController::accuracy(const Ctxt &x_neg, const Ctxt &x_pos, const Ptxt &p_labels,
                              double min, double max, int d) {
+    if (sign_backend == SignBackend::SCHEME_SWITCH) {
+        return accuracy_from_comparison(compare_scheme_switching(x_neg, x_pos, p_labels->GetLength()), p_labels);
+    }
+
     Ctxt diff = context->EvalSub(x_neg, x_pos);
-    diff = bootstrap(diff);
+    //The composite backend bootstraps between its stages by itself (on values in [-1, 1])
+    int needed = sign_backend == SignBackend::COMPOSITE ? 1 : sign_depth(min, max, d);
+    if (remaining_levels(diff) < needed) diff = bootstrap(diff);
 
     Ctxt pred_label = eval_sign_function(diff, min, max, d);
-    pred_label = bootstrap(pred_label);
+    if (remaining_levels(pred_label) < 2) pred_label = bootstrap(pred_label); // labels product + 0.5
 
     // match = (pred_label * true_label + 1) * 1/2
     Ctxt match = context->EvalMult(pred_label, p_labels); // pred_label * true_label
@@ -1544,6 +2604,104 @@ Ctxt FHEController::accuracy(const Ctxt &x_neg, const Ctxt &x_pos, const Ptxt &p
     return match;
 }
 
+// less = [neg < pos] is the POS prediction, so pred_label = 2 * less - 1 and
+// match = (pred_label * y + 1) / 2 = (less - 1/2) * y + 1/2: one level instead of sign + 2
+Ctxt FHEController::accuracy_from_comparison(const Ctxt &less, const Ptxt &p_labels) {
+    Ctxt match = context->EvalSub(less, 0.5);
+    match = context->EvalMult(match, p_labels);
+    match = context->EvalAdd(match, 0.5);
+
+    return match;
+}
+
+void FHEController::set_scheme_switch_bound(double bound) {
+    // FHEW sees round(scale * (a - b)) modulo plwe: the sign is right only below plwe / 2.
+    // One unit of headroom for the rounding; differences below 1 / scale round to 0 ("not less")
+    double limit = scheme_switch_plwe / 2.0 - 1;
+    scheme_switch_scale = bound > limit ? limit / bound : 1;
+}
+
+Ctxt FHEController::compare_scheme_switching(const Ctxt &a, const Ctxt &b, int n) {
+    // CKKS -> FHEW (n LWE ciphertexts), exact sign by FHEW bootstrapping, FHEW -> CKKS
+    Ctxt less = context->EvalCompareSchemeSwitching(a, b, n, num_slots, scheme_switch_plwe, scheme_switch_scale);
+    if (remaining_levels(less) < 1) less = bootstrap(less);
+
+    return less;
+}
+
+// acc <- rotate(acc + logit, 1): after n samples the NEG logit of sample k is in slot num_slots - n + k
+// and the POS one (kept in slot 1) in slot num_slots - n + k + 1. accumulated_logits realigns each vector
+// with one rotate_composed: up to log2(num_slots) power-of-two rotations, no dedicated key needed
+void FHEController::accumulate_logits(LogitAccumulator &acc, const Ctxt &classified, double scale) {
+    if (acc.count == num_slots) {
+        cerr << "More than " << num_slots << " samples in one logit accumulator" << endl;
+        exit(1);
+    }
+
+    vector<double> neg_mask(num_slots, 0), pos_mask(num_slots, 0);
+    neg_mask[0] = scale;
+    pos_mask[1] = scale;
+
+    Ctxt neg = mult(classified, encode(neg_mask, classified->GetLevel(), num_slots));
+    Ctxt pos = mult(classified, encode(pos_mask, classified->GetLevel(), num_slots));
+    if (acc.count > 0) {
+        add_inplace(neg, acc.neg);
+        add_inplace(pos, acc.pos);
+    }
+
+    acc.neg = rotate(neg, 1);
+    acc.pos = rotate(pos, 1);
+    acc.count++;
+}
+
+pair<Ctxt, Ctxt> FHEController::accumulated_logits(const LogitAccumulator &acc, int offset) {
+    // rotate(c, r) moves slot s + r to s. Sample k sits in slot k - n (NEG) and 1 + k - n (POS).
+    // Positive rotations only: every power of two up to num_slots / 2 has a key
+    int n = acc.count;
+    int neg_rotation = ((num_slots - n - offset) % num_slots + num_slots) % num_slots;
+    int pos_rotation = (neg_rotation + 1) % num_slots;
+
+    return {rotate_composed(acc.neg, neg_rotation), rotate_composed(acc.pos, pos_rotation)};
+}
+
+Ctxt FHEController::partial_state(const Ctxt &match, int n) {
+    Ctxt masked = match;
+    if (remaining_levels(masked) < 1) masked = bootstrap(masked);
+
+    // Padding slots hold 0.5 (label 0), only the first n take part in the sum
+    vector<double> mask(num_slots, 0);
+    for (int i = 0; i < n; i++) mask[i] = 1;
+    masked = mult(masked, encode(mask, masked->GetLevel(), num_slots));
+
+    // Over all the slots (log2(num_slots) rotations): the total lands in every slot, not only in slot 0
+    return rotsum(masked, num_slots, 1);
+}
+
+void FHEController::save_partial(const Ctxt &partial, int n, const string &filename) {
+    save(partial, filename);
+
+    ofstream count_file(filename + ".count");
+    if (!count_file.is_open()) {
+        cerr << "Cannot write " << filename + ".count" << endl;
+        exit(1);
+    }
+    count_file << n << endl;
+}
+
+int FHEController::read_partial_count(const string &filename) {
+    ifstream count_file(filename + ".count");
+    int n;
+    if (!(count_file >> n)) {
+        cerr << "Cannot read the sample count from " << filename + ".count" << endl;
+        exit(1);
+    }
+    return n;
+}
+
+int FHEController::remaining_levels(const Ctxt &c) {
+    return circuit_depth - 2 - static_cast<int>(c->GetLevel());
+}
+
 Ctxt FHEController::rotate_composed(const Ctxt& ctxt, int rot) {
     Ctxt result = ctxt;
 
@@ -1577,9 +2735,12 @@ Ctxt FHEController::rotate_composed(const Ctxt& ctxt, int rot) {
 // after
 // res: [x0, x1, x2, x3]
 Ctxt FHEController::unwrap_vector_ctxts(const vector<Ctxt> &ctxts, size_t slot_count) {
-    Ctxt res = ctxts[0];
-    for (size_t i = 1; i < slot_count; i++) {
-        res = context->EvalAdd(res, rotate_composed(ctxts[i], -i));
+    if (slot_count <= 1) return ctxts[0];
+
+    //First addition allocates the accumulator, so ctxts[0] is never modified in place
+    Ctxt res = add(ctxts[0], rotate_composed(ctxts[1], -1));
+    for (size_t i = 2; i < slot_count; i++) {
+        add_inplace(res, rotate_composed(ctxts[i], -i));
     }
     return res;
 }
@@ -6,7 +6,12 @@
 #include "scheme/ckksrns/ckksrns-ser.h"
 #include "cryptocontext-ser.h"
 #include "key/key-ser.h"
+#include "binfhecontext-ser.h"
 #include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <array>
 #include "Utils.h"
 
 using namespace lbcrypto;
@@ -17,6 +22,49 @@ using namespace utils;
 using Ptxt = Plaintext;
 using Ctxt = Ciphertext<DCRTPoly>;
 
+// Refinement of the inverse: Newton y <- y * (2 - x * y) costs 2 levels per iteration, Goldschmidt
+// (y <- y * (1 + e), e <- e^2) reaches the same precision with 1 level per iteration plus 1
+enum class InverseMethod { NEWTON, GOLDSCHMIDT };
+
+// Backend of eval_sign_function: one Chebyshev interpolation, or a composition of small odd polynomials.
+// SCHEME_SWITCH is only used by accuracy(): exact comparison in FHEW, needs load_scheme_switching_keys()
+enum class SignBackend { CHEBYSHEV, COMPOSITE, SCHEME_SWITCH };
+
+// Composite sign: g_family applied g_count times, then f_family f_count times (Cheon et al., 2020)
+struct SignSchedule {
+    int family;
+    int g_count;
+    int f_count;
+    int depth;
+    double error; // worst |1 - |sign(x)|| for margin <= |x| <= 1
+};
+
+// Secret-key ciphertext (b, a) whose uniform component a is expanded from `seed`: only b and the seed
+// are serialized (save_seeded), the loaders regenerate a
+struct SeededCtxt {
+    Ctxt c;
+    array<uint8_t, 32> seed;
+};
+
+// NEG/POS logit vectors built sample by sample (accumulate_logits): the k-th sample ends up in slot k
+struct LogitAccumulator {
+    Ctxt neg;
+    Ctxt pos;
+    int count = 0;
+};
+
+// Public-key encryptions of zero computed ahead of time: encrypting an input is then encode + add.
+// Every zero is used once and removed from the pool
+struct ZeroPool {
+    mutex m;
+    condition_variable changed;
+    deque<Ctxt> zeros;
+    size_t target = 0;  // refill thread keeps this many zeros ready
+    int level = 0;
+    bool stop = false;
+    thread refill;
+};
+
 class FHEController {
     CryptoContext<DCRTPoly> context;
 
@@ -45,6 +93,10 @@ public:
     void clear_rotation_keys();
     void clear_context(int bootstrapping_key_slots);
 
+    // CKKS <-> FHEW scheme switching (requires scheme_switching = true before generate_context)
+    void generate_scheme_switching_keys(bool serialize = false);
+    void load_scheme_switching_keys(bool verbose = true);
+
     // Encoding/Encryption
     Ptxt encode(const vector<double>& vec, int level, int plaintext_num_slots);
     Ptxt encode(double val, int level, int plaintext_num_slots);
@@ -52,20 +104,47 @@ public:
     Ctxt encrypt_weights(const vector<double>& vec, int level = 0, int plaintext_num_slots = 0);
     Ctxt encrypt_ptxt(const Ptxt& p);
 
+    // Offline/online encryption: zero_pool + encode/add. Falls back to encrypt_ptxt when no zero is ready
+    Ctxt encrypt_pooled(const Ptxt& p);
+    void start_zero_pool(size_t target, int level = 0);
+    void stop_zero_pool();
+    // Persisted pool: one file per zero in `folder`, claimed by rename so that no process reuses one
+    void precompute_zeros(const string &folder, int count, int level = 0);
+    Ctxt encrypt_from_pool(const Ptxt& p, const string &folder);
+
+    // Data owner side (needs the secret key): half-size uploads
+    SeededCtxt encrypt_seeded(const vector<double>& vec, int level = 0, int plaintext_num_slots = 0);
+    SeededCtxt encrypt_ptxt_seeded(const Ptxt& p);
+
     // Decryption
     Ptxt decrypt(const Ctxt& c);
     vector<double> decrypt_tovector(const Ctxt& c, int slots);
 
     // Homomorphic operations
     Ctxt add(const Ctxt &c1, const Ctxt &c2);
-    Ctxt add(const Ctxt &c1, Ptxt &c2);
-    Ctxt add(vector<Ctxt> c);
+    Ctxt add(const Ctxt &c1, const Ptxt &c2);
+    Ctxt add(const vector<Ctxt> &c);
+    Ctxt sub(const Ctxt &c1, const Ctxt &c2);
 
     Ctxt mult(const Ctxt &c1, const Ptxt &p);
     Ctxt mult(const Ctxt &c1, const Ctxt& c2);
     Ctxt mult(const Ctxt &c, double d);
 
     Ctxt rotate(const Ctxt &c, int index);
+
+    // In-place operations: the first argument is overwritten with the result.
+    // Only call them on ciphertexts owned by the caller (never on loaded weights
+    // that are shared between samples).
+    void add_inplace(Ctxt &c1, const Ctxt &c2);
+    void add_inplace(Ctxt &c, const Ptxt &p);
+    void add_inplace(Ctxt &c, double d);
+    void sub_inplace(Ctxt &c1, const Ctxt &c2);
+    void sub_inplace(Ctxt &c, const Ptxt &p);
+    void mult_inplace(Ctxt &c, double d);
+    void mult_inplace(Ctxt &c, const Ptxt &p);
+    void rotate_inplace(Ctxt &c, int index);
+    void rescale_inplace(Ctxt &c);
+
     Ctxt bootstrap(const Ctxt &c, bool timing = false);
     Ctxt bootstrap(const Ctxt &c, int precision, bool timing = false);
 
@@ -73,26 +152,41 @@ public:
     Ctxt relu_wide(const Ctxt &c, double a, double b, int degree, double scale, bool timing = false);
 
     // Matrix operations
-    vector<Ctxt> matmulRE(vector<Ctxt> rows, Ctxt &weight, Ctxt &bias);
-    vector<Ctxt> matmulRE(vector<Ctxt> rows, Ctxt &weight, Ctxt &bias, int row_size, int padding);
-    vector<Ctxt> matmulRE(vector<Ctxt> rows, Ctxt &weight, int row_size, int padding);
-    vector<Ctxt> matmulRElarge(vector<Ctxt>& inputs, vector<Ctxt> &weights, Ctxt &bias, double mask_val = 1);
-    vector<Ctxt> matmulCR(vector<Ctxt> rows, Ctxt& weight, Ctxt& bias);
-    vector<Ctxt> matmulCR(vector<Ctxt> rows, Ctxt& matrix);
-    vector<Ctxt> matmulCRlarge(vector<vector<Ctxt>> rows, vector<Ctxt> weights, Ctxt &bias);
-
-    Ctxt matmulScores(vector<Ctxt> queries, Ctxt &key);
+    vector<Ctxt> matmulRE(const vector<Ctxt> &rows, Ctxt &weight, Ctxt &bias);
+    vector<Ctxt> matmulRE(const vector<Ctxt> &rows, Ctxt &weight, Ctxt &bias, int row_size, int padding);
+    vector<Ctxt> matmulRE(const vector<Ctxt> &rows, Ctxt &weight, int row_size, int padding);
+    vector<Ctxt> matmulRElarge(const vector<Ctxt> &inputs, const vector<Ctxt> &weights, Ctxt &bias, double mask_val = 1);
+    vector<Ctxt> matmulCR(const vector<Ctxt> &rows, Ctxt& weight, Ctxt& bias);
+    vector<Ctxt> matmulCR(const vector<Ctxt> &rows, Ctxt& matrix);
+    vector<Ctxt> matmulCRlarge(const vector<vector<Ctxt>> &rows, const vector<Ctxt> &weights, Ctxt &bias);
+
+    // Fused multiply-accumulate: sum(lhs[i] * rhs[i]) with one relinearization and one rescale per output
+    Ctxt mult_accumulate(const vector<Ctxt> &lhs, const vector<Ctxt> &rhs);
+    Ctxt dot_product(const vector<Ctxt> &lhs, const vector<Ctxt> &rhs, int row_size, int padding, const Ctxt &bias = nullptr);
+
+    Ctxt matmulScores(const vector<Ctxt> &queries, Ctxt &key);
+    int nested_threads() const;
+
+    // Diagonal matrix-vector product with baby-step/giant-step rotations. The input holds a
+    // d_in vector replicated with period d_in (read_plain_repeated_input layout), the output
+    // holds the d_out result replicated with period d_out, so layers can be chained.
+    Ctxt matvec_bsgs(const Ctxt &in, const vector<Ctxt> &diagonals, int d_in, int d_out);
+    Ctxt matvec_bsgs(const Ctxt &in, const vector<Ptxt> &diagonals, int d_in, int d_out);
+    vector<vector<double>> matrix_diagonals(const vector<double> &matrix, int d_in, int d_out, bool transposed = false);
+    vector<Ptxt> read_plain_diagonals(const string& filename, int d_in, int d_out, int level = 0, double scale = 1, bool transposed = false);
+    static vector<int> bsgs_rotation_indices(int d_in, int d_out);
+    static int bsgs_baby_steps(int diagonals);
 
     // Wrapping/unwrapping
-    Ctxt wrapUpRepeated(vector<Ctxt> vectors);
-    Ctxt wrapUpExpanded(vector<Ctxt> vectors);
+    Ctxt wrapUpRepeated(const vector<Ctxt> &vectors);
+    Ctxt wrapUpExpanded(const vector<Ctxt> &vectors);
     vector<Ctxt> unwrapExpanded(Ctxt c, int inputs_num);
-    vector<vector<Ctxt>> unwrapRepeatedLarge(vector<Ctxt> containers, int input_number);
+    vector<vector<Ctxt>> unwrapRepeatedLarge(const vector<Ctxt> &containers, int input_number);
     vector<Ctxt> unwrapScoresExpanded(Ctxt c, int inputs_num);
     vector<Ctxt> unwrap_512_in_4_128(const Ctxt& c, int index);
 
-    vector<Ctxt> generate_containers(vector<Ctxt> inputs, const Ctxt& bias = nullptr);
-    Ctxt wrap_containers(vector<Ctxt> c, int inputs_number);
+    vector<Ctxt> generate_containers(const vector<Ctxt> &inputs, const Ctxt& bias = nullptr);
+    Ctxt wrap_containers(const vector<Ctxt> &c, int inputs_number);
 
     // Masking operations
     Ctxt mask_block(const Ctxt& c, int from, int to, double mask_value = 1);
@@ -104,11 +198,34 @@ public:
     // Polynomial evaluations
     // TODO: переписать функции, убрать mult, сделать min/max-bound
     Ctxt eval_exp(const Ctxt &c, int inputs_number);
-    Ctxt eval_inverse(const Ctxt &c, double min, double max);
+    // Fused attention softmax on the matmulScores layout (query i of head h, key j in slot 128j + 64h + i).
+    // [min_sum, max_sum] bounds the sum of the exponentials of a query
+    Ctxt softmax(const Ctxt &scores, int inputs_number, double min_sum = 2, double max_sum = 5000,
+                 int inverse_degree = 59, int inverse_iterations = 2);
+    // 1 / x for x in [min, max]: Chebyshev seed of degree seed_degree, then `iterations` refinements.
+    // The relative error of the seed e0 becomes e0^(2^iterations), see inverse_precision/inverse_depth
+    Ctxt eval_inverse(const Ctxt &c, double min, double max, int seed_degree = 27, int iterations = 3,
+                      InverseMethod method = InverseMethod::GOLDSCHMIDT);
+    static int inverse_depth(int seed_degree, int iterations, InverseMethod method = InverseMethod::GOLDSCHMIDT);
+    static double inverse_precision(double min, double max, int seed_degree, int iterations);
     Ctxt eval_inverse_naive(const Ctxt &c, double min, double max);
     Ctxt eval_inverse_naive_2(const Ctxt &c, double min, double max, double mult);
     Ctxt eval_gelu_function(const Ctxt &c, double min, double max, double mult, int degree);
     Ctxt eval_tanh_function(const Ctxt &c, double min, double max, double mult, int degree);
+    // Symmetric functions on [-bound, bound]: odd f(x) = x * g(x^2), even f(x) = h(x^2), so only half of the
+    // Chebyshev basis (degree / 2) is evaluated. One more level than EvalChebyshevFunction for odd functions
+    Ctxt eval_odd_function(const function<double(double)> &f, const Ctxt &c, double bound, int degree);
+    Ctxt eval_even_function(const function<double(double)> &f, const Ctxt &c, double bound, int degree);
+    // 1 / sqrt(scale * x) for x in [min, max]: Chebyshev seed refined with Newton steps (3 levels each)
+    Ctxt eval_inverse_sqrt(const Ctxt &c, double min, double max, double scale = 1, int seed_degree = 27, int newton_steps = 1);
+    static int inverse_sqrt_depth(int seed_degree, int newton_steps);
+
+    // LayerNorm over the features of each token, wrapped layout (feature j of token i in slot 128j + i).
+    // gamma/beta are in the expanded layout, [var_min, var_max] bounds the variance of a token
+    Ctxt layernorm(const Ctxt &c, int inputs_number, const Ctxt &gamma, const Ctxt &beta,
+                   double var_min, double var_max, int seed_degree = 27, int newton_steps = 1);
+    Ctxt layernorm(const Ctxt &c, int inputs_number, const Ptxt &gamma, const Ptxt &beta,
+                   double var_min, double var_max, int seed_degree = 27, int newton_steps = 1);
 
     // Utility operations
     Ctxt rotsum(const Ctxt &in, int slots, int padding);
@@ -123,6 +240,9 @@ public:
 
     Ptxt read_plain_input(const string& filename, int level = 0, double scale = 1);
     Ptxt read_plain_repeated_input(const string& filename, int level = 0, double scale = 1);
+    Ptxt read_plain_repeated_input(const string& filename, int level, double scale, int period);
+    Ptxt encode_repeated(const double *values, int period = 128, int level = 0, double scale = 1);
+    Ptxt encode_expanded(const double *values, int level = 0, double scale = 1);
     Ptxt read_plain_repeated_512_input(const string& filename, int level = 0, double scale = 1);
     Ptxt read_plain_expanded_input(const string& filename, int level = 0, double scale = 1);
     Ptxt read_plain_expanded_input(const string& filename, int level, double scale, int num_inputs);
@@ -132,16 +252,31 @@ public:
     void print_expanded(const Ctxt &c, int slots = 0, int expansion_factor = 1, string prefix = "");
     void print_min_max(const Ctxt &c);
 
-    // Serialization
-    void save(Ctxt v, std::string filename);
-    void save(vector<Ctxt> v, std::string filename);
-    vector<Ctxt> load_vector(string filename);
-    Ctxt load_ciphertext(string filename);
+    // Serialization. save() writes the cereal format, save_raw() the raw one (opt-in: internal files);
+    // the loaders detect raw, seeded or cereal files by their magic
+    void save(const Ctxt &v, const string &filename);
+    void save(const vector<Ctxt> &v, const string &filename);
+    vector<Ctxt> load_vector(const string &filename);
+    Ctxt load_ciphertext(const string &filename);
+    void save_raw(const Ctxt &v, const string &filename);
+    void save_raw(const vector<Ctxt> &v, const string &filename);
+    vector<Ctxt> load_raw(const string &filename);
+    void save_seeded(const SeededCtxt &v, const string &filename);
+    void save_seeded(const vector<SeededCtxt> &v, const string &filename);
     Ctxt load_encrypted_expand(string filename, int num_inputs);
 
     // Ctxt f4(Ctxt x);
     // Ctxt sign_x(const Ctxt & x, int d = 2);
     Ctxt eval_sign_function(const Ctxt &c, double min, double max, int degree);
+    // -sign(x) for margin <= |x| <= bound, with error below 2^-precision_bits
+    Ctxt eval_composite_sign(const Ctxt &c, double bound, double margin, int precision_bits);
+    static SignSchedule composite_sign_schedule(double epsilon, int precision_bits);
+    static void print_composite_sign_table();
+    int sign_depth(double min, double max, int degree);
+    // 1 where a < b, 0 elsewhere, for the first n slots (exact up to the FHEW rounding)
+    Ctxt compare_scheme_switching(const Ctxt &a, const Ctxt &b, int n);
+    // scheme_switch_scale for |a - b| <= bound (Calibration::sign_bound): larger differences would wrap modulo plwe
+    void set_scheme_switch_bound(double bound);
     Ctxt sign_difference(const Ctxt &x, const Ctxt &y,
         double min = -1, double max = 1, int d = 25);
 
@@ -150,19 +285,66 @@ public:
     Ctxt accuracy(const Ctxt &x_neg, const Ctxt &x_pos, const Ptxt &p_labels,
         double min = -1, double max = 1, int d = 25);
 
+    // Classifier output (NEG in slot 0, POS in slot 1) times `scale` into the next slot of the accumulators:
+    // one masking product and one rotation by 1 per accumulator, instead of split_2_slots + unwrap_vector_ctxts
+    void accumulate_logits(LogitAccumulator &acc, const Ctxt &classified, double scale = 100);
+    // {NEG, POS} with the logits of sample k in slot offset + k: accumulators of consecutive chunks of
+    // samples, realigned to their offsets, are simply added
+    pair<Ctxt, Ctxt> accumulated_logits(const LogitAccumulator &acc, int offset = 0);
+
+    // Sum of the first n matches in every slot (masked rotsum over all num_slots) and its plain count (<filename>.count):
+    // partials of different batches are merged with additions only (benchmark_eval --merge)
+    Ctxt partial_state(const Ctxt &match, int n);
+    void save_partial(const Ctxt &partial, int n, const string &filename);
+    static int read_partial_count(const string &filename);
+
+    // Multiplicative levels left before a bootstrap is required
+    int remaining_levels(const Ctxt &c);
+
     Ctxt rotate_composed(const Ctxt& ctxt, int rot);
     Ctxt unwrap_vector_ctxts(const vector<Ctxt> &ctxts, size_t slot_count);
 
-    vector<Ctxt> slicing(vector<Ctxt> &arr, int X, int Y);
+    vector<Ctxt> slicing(const vector<Ctxt> &arr, int X, int Y);
     // vector<Ctxt> split_slots_by_rotation(const Ctxt& input, size_t slot_count);
     vector<Ctxt> split_2_slots(const Ctxt& input);
 
 
     int relu_degree = 119;
+    // Encoder helpers: threads of the outer loops over tokens/containers (1 = sequential), nested
+    // parallelism is limited to the cores left per worker (nested_threads)
+    int ciphertext_workers = 4;
+    double softmax_r = 1 / 8.0; //Scores are scaled by r, exp is then raised to 1/r (power of 2)
+    // Odd activations on symmetric intervals use eval_odd_function (fewer products, +1 level); opt-in
+    bool tanh_odd = false;
+    bool sign_odd = false;
+
+    SignBackend sign_backend = SignBackend::CHEBYSHEV;
+    double sign_margin = 1;  // smallest |x| that must get the right sign (composite backend)
+    int sign_precision = 4;  // bits, composite backend
+    bool scheme_switching = false;     // enable SCHEMESWITCH in generate_context
+    uint32_t scheme_switch_plwe = 512; // FHEW plaintext modulus, |a - b| * scale must stay below plwe / 2
+    double scheme_switch_scale = 1;    // set_scheme_switch_bound, before the keys are generated/loaded
     string parameters_folder = "keys";
 
 private:
+    template <typename T>
+    Ctxt matvec_bsgs_impl(const Ctxt &in, const vector<T> &diagonals, int d_in, int d_out);
+    Ctxt diagonal_block(const vector<Ctxt> &babies, const vector<Ctxt> &diagonals, int first, int count);
+    Ctxt diagonal_block(const vector<Ctxt> &babies, const vector<Ptxt> &diagonals, int first, int count);
+    template <typename T>
+    Ctxt layernorm_impl(const Ctxt &c, int inputs_number, const T &gamma, const T &beta,
+                        double var_min, double var_max, int seed_degree, int newton_steps);
+
+    Ctxt accuracy_from_comparison(const Ctxt &less, const Ptxt &p_labels);
+    void write_raw(FILE *out, const Ctxt &c, size_t elements_count = 0);
+    Ctxt read_raw(const char *&cursor, const char *end, const string &filename);
+    Ctxt read_seeded(const char *&cursor, const char *end, const string &filename);
+    static DCRTPoly expand_seed(const array<uint8_t, 32> &seed, const shared_ptr<DCRTPoly::Params> &params);
+
+    Ctxt encrypt_zero(int level);
+
     KeyPair<DCRTPoly> key_pair;
+    shared_ptr<ZeroPool> zero_pool = make_shared<ZeroPool>();
     vector<uint32_t> level_budget = {14, 14};
 };
 
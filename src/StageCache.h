@@ -0,0 +1,117 @@
+#ifndef FHE_BERT_STAGECACHE_H
+#define FHE_BERT_STAGECACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "FHEController.h"
+
+/*
+ * Content-addressed cache of intermediate ciphertexts (pooled, classified, ...).
+ * Entry key = FNV-1a 64 of (input digest, weights manifest, parameters, stage name): a rerun with the
+ * same inputs, weights and flags finds the entries of the samples completed before a crash, any change
+ * to one of them gives new keys. Entries are written to <key>.tmp and renamed, so a crash mid-write
+ * never leaves a truncated entry behind.
+ */
+class StageCache {
+public:
+    StageCache() = default;
+
+    // folder: cache directory, parameters: every setting that changes the results (flags, keys, ...)
+    StageCache(const std::string &folder, const std::string &parameters) : folder(folder), enabled(true) {
+        std::filesystem::create_directories(folder);
+        context = hash_string(parameters);
+    }
+
+    // Weights manifest: name, size and modification time of every file, in sorted order
+    void add_manifest(const std::string &weights_folder) {
+        if (!enabled || !std::filesystem::is_directory(weights_folder)) return;
+
+        std::vector<std::filesystem::path> files;
+        for (const auto &entry : std::filesystem::directory_iterator(weights_folder)) {
+            if (entry.is_regular_file()) files.push_back(entry.path());
+        }
+        std::sort(files.begin(), files.end());
+
+        for (const auto &file : files) {
+            context = hash_string(file.filename().string(), context);
+            context = hash_value(std::filesystem::file_size(file), context);
+            context = hash_value(std::filesystem::last_write_time(file).time_since_epoch().count(), context);
+        }
+    }
+
+    bool active() const { return enabled; }
+
+    // Digest of the input files of a sample (contents, in the given order)
+    static uint64_t digest_files(const std::vector<std::string> &files) {
+        uint64_t h = OFFSET;
+        for (const auto &file : files) {
+            std::ifstream in(file, std::ios::binary);
+            char buffer[1 << 16];
+            while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+                h = hash_bytes(buffer, in.gcount(), h);
+            }
+        }
+        return h;
+    }
+
+    static uint64_t digest_values(const std::vector<double> &values) {
+        return hash_bytes(values.data(), values.size() * sizeof(double), OFFSET);
+    }
+
+    std::string path(uint64_t input, const std::string &stage) const {
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash_string(stage, hash_value(input, context)));
+        return folder + "/" + stage + "_" + key + ".enc";
+    }
+
+    bool contains(uint64_t input, const std::string &stage) const {
+        return enabled && std::filesystem::exists(path(input, stage));
+    }
+
+    Ctxt load(FHEController &controller, uint64_t input, const std::string &stage) const {
+        return controller.load_ciphertext(path(input, stage));
+    }
+
+    void store(FHEController &controller, uint64_t input, const std::string &stage, const Ctxt &c) const {
+        if (!enabled) return;
+
+        std::string target = path(input, stage);
+        controller.save_raw(c, target + ".tmp");
+        std::filesystem::rename(target + ".tmp", target);
+    }
+
+private:
+    static constexpr uint64_t OFFSET = 14695981039346656037ULL;
+    static constexpr uint64_t PRIME = 1099511628211ULL;
+
+    static uint64_t hash_bytes(const void *data, size_t size, uint64_t h) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+            h ^= bytes[i];
+            h *= PRIME;
+        }
+        return h;
+    }
+
+    static uint64_t hash_string(const std::string &s, uint64_t h = OFFSET) {
+        // The length keeps ("ab", "c") and ("a", "bc") apart
+        return hash_bytes(s.data(), s.size(), hash_value(s.size(), h));
+    }
+
+    template <typename T>
+    static uint64_t hash_value(T value, uint64_t h) {
+        return hash_bytes(&value, sizeof(value), h);
+    }
+
+    std::string folder;
+    bool enabled = false;
+    uint64_t context = OFFSET;
+};
+
+#endif
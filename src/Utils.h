@@ -152,6 +152,50 @@ namespace utils {
         exit(1);
     }
 
+    //Chebyshev interpolation of f on [a, b] (same nodes and c0/2 convention as EvalChebyshevCoefficients),
+    //used to estimate in plaintext the error of a polynomial before evaluating it on a ciphertext
+    static inline vector<double> chebyshev_coefficients(const function<double(double)> &f, double a, double b, int degree) {
+        int n = degree + 1;
+        vector<double> values(n);
+        for (int k = 0; k < n; k++) {
+            values[k] = f((b - a) / 2 * cos(M_PI * (k + 0.5) / n) + (a + b) / 2);
+        }
+
+        vector<double> coefficients(n);
+        for (int j = 0; j < n; j++) {
+            double sum = 0;
+            for (int k = 0; k < n; k++) sum += values[k] * cos(M_PI * j * (k + 0.5) / n);
+            coefficients[j] = 2.0 / n * sum;
+        }
+
+        return coefficients;
+    }
+
+    static inline double chebyshev_evaluate(const vector<double> &coefficients, double a, double b, double x) {
+        //Clenshaw recurrence
+        double t = (2 * x - a - b) / (b - a);
+        double b1 = 0, b2 = 0;
+        for (int j = coefficients.size() - 1; j >= 1; j--) {
+            double tmp = 2 * t * b1 - b2 + coefficients[j];
+            b2 = b1;
+            b1 = tmp;
+        }
+
+        return t * b1 - b2 + coefficients[0] / 2;
+    }
+
+    //Depth of EvalChebyshevFunction for any degree, as in the FUNCTION_EVALUATION.md table
+    //(degree 6-13 -> 5, 14-27 -> 6, ..., 120-247 -> 9); get_relu_depth only knows the tabulated degrees
+    static inline int chebyshev_depth(int degree) {
+        int depth = 4;
+        for (int limit : {5, 13, 27, 59, 119, 247, 495, 1007, 2031}) {
+            if (degree <= limit) return depth;
+            depth++;
+        }
+
+        return depth;
+    }
+
     static inline void write_to_file(string filename, string content) {
         ofstream file;
         file.open (filename);
@@ -1,11 +1,13 @@
 #include <iostream>
 #include "FHEController.h"
 #include <regex>
+#include <fstream>
 #include <filesystem>
 #include <algorithm>
 #include <vector>
 #include <string>
 #include "Utils.h"
+#include "Calibration.h"
 
 namespace fs = std::filesystem;
 using namespace utils;
@@ -19,6 +21,14 @@ string result_name;
 string labels_file;
 bool verbose = false;
 bool plain = false;
+bool sign_table = false;
+bool benchmark_sign = false;
+bool merge_mode = false;
+vector<string> partial_paths; // --merge inputs
+int block_size = 0;           // samples per block, 0 = num_slots
+int block_workers = 0;        // blocks evaluated at the same time, 0 = min(blocks, cores)
+int load_workers = 0;         // threads loading and packing the result files, 0 = cores
+Calibration calibration;      // --calibration: sign interval and degree (calibrate.py)
 
 
 int round_01(double x) {
@@ -36,15 +46,16 @@ int round_01(double x) {
 std::vector<std::string> getFilesSortedByNumber(const std::string& input_path) {
     std::vector<std::string> files;
 
+    // регулярка вытаскивает число перед ".txt.enc"
+    std::regex re(R"(.*?(\d+)\.txt\.enc$)");
+
+    // Only finished results: res_i.txt.enc.tmp of an interrupted writer is skipped
     for (auto& p : std::filesystem::directory_iterator(input_path)) {
-        if (p.is_regular_file()) {
+        if (p.is_regular_file() && std::regex_match(p.path().string(), re)) {
             files.push_back(p.path().string());
         }
     }
 
-    // регулярка вытаскивает число перед ".txt.enc"
-    std::regex re(R"(.*?(\d+)\.txt\.enc$)");
-
     std::sort(files.begin(), files.end(),
         [&](const std::string& a, const std::string& b) {
             std::smatch ma, mb;
@@ -58,74 +69,235 @@ std::vector<std::string> getFilesSortedByNumber(const std::string& input_path) {
 
     return files;
 }
+// Same logits through every sign backend: time of accuracy() and decrypted agreement with the
+// exact (scheme switching) comparison, when its keys are available
+void benchmark_sign_backends(const Ctxt &c_neg, const Ctxt &c_pos, const vector<double> &labels,
+                             double min, double max, int degree) {
+    vector<pair<string, SignBackend>> backends = {
+        {"chebyshev", SignBackend::CHEBYSHEV},
+        {"composite", SignBackend::COMPOSITE}
+    };
+    if (fs::exists(controller.parameters_folder + "/binfhe-context.txt")) {
+        backends.push_back({"schemeswitch", SignBackend::SCHEME_SWITCH});
+    } else {
+        cout << "No scheme switching keys in " << controller.parameters_folder << ", skipping schemeswitch" << endl;
+    }
+
+    size_t n = labels.size();
+    vector<vector<int>> matches;
+
+    for (auto &backend : backends) {
+        controller.sign_backend = backend.second;
+
+        auto start = start_time();
+        Ctxt acc_enc = controller.accuracy(c_neg, c_pos, labels, min, max, degree);
+        print_duration(start, "Accuracy (" + backend.first + ")");
+
+        if (verbose) {
+            vector<double> dec = controller.decrypt_tovector(acc_enc, n);
+            vector<int> rounded;
+            int correct = 0;
+            for (size_t i = 0; i < n; i++) {
+                rounded.push_back(round_01(dec[i]));
+                correct += rounded.back();
+            }
+            matches.push_back(rounded);
+            cout << backend.first << ": approximate accuracy " << (double) correct / n << endl;
+        }
+    }
+
+    if (verbose && backends.back().second == SignBackend::SCHEME_SWITCH) {
+        for (size_t b = 0; b + 1 < backends.size(); b++) {
+            int disagree = 0;
+            for (size_t i = 0; i < n; i++) disagree += matches[b][i] != matches.back()[i];
+            cout << backends[b].first << " vs schemeswitch: " << disagree << "/" << n << " samples differ" << endl;
+        }
+    }
+}
+
+// Logits of samples first..first+count-1, packed for slots offset..offset+count-1
+pair<Ctxt, Ctxt> pack_chunk(const vector<string> &paths, int first, int count, int offset) {
+    LogitAccumulator logits;
+    for (int i = first; i < first + count; i++) {
+        if (verbose) {
+            #pragma omp critical
+            cout << "Processing " << paths[i] << endl;
+        }
+        Ctxt classified = controller.load_ciphertext(paths[i]); // have 2 levels
+        // out from zero — better sgn func approx (check notebook sign_approx.ipynb)
+        // logit 0.001 -> 0.1, etc
+        controller.accumulate_logits(logits, classified, 100); // +1
+    }
+    return controller.accumulated_logits(logits, offset);
+}
+
+// {NEG, POS} of every block of block_size samples. The blocks are cut into chunks of consecutive files,
+// loaded and packed by `workers` threads (each chunk starts packing with its first file); the chunks
+// of a block are then added in order, so the result does not depend on the scheduling
+vector<pair<Ctxt, Ctxt>> load_blocks(const vector<string> &paths, int n, int workers) {
+    int blocks = (n + block_size - 1) / block_size;
+    int chunks_per_block = std::max(1, (workers + blocks - 1) / blocks);
+
+    vector<array<int, 4>> chunks; // block, first file, count, offset in the block
+    for (int b = 0; b < blocks; b++) {
+        int first = b * block_size;
+        int count = std::min(block_size, n - first);
+        // Realigning a chunk takes up to log2(num_slots) rotations per vector: at least 16 samples per chunk
+        int k = std::min(chunks_per_block, std::max(1, count / 16));
+        for (int c = 0; c < k; c++) {
+            int a = count * c / k;
+            chunks.push_back({b, first + a, count * (c + 1) / k - a, a});
+        }
+    }
+
+    vector<pair<Ctxt, Ctxt>> packed(chunks.size());
+
+    #pragma omp parallel for schedule(dynamic) num_threads(workers)
+    for (size_t c = 0; c < chunks.size(); c++) {
+        packed[c] = pack_chunk(paths, chunks[c][1], chunks[c][2], chunks[c][3]);
+    }
+
+    vector<pair<Ctxt, Ctxt>> result(blocks);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        pair<Ctxt, Ctxt> &block = result[chunks[c][0]];
+        if (!block.first) {
+            block = packed[c];
+        } else {
+            controller.add_inplace(block.first, packed[c].first);
+            controller.add_inplace(block.second, packed[c].second);
+        }
+    }
+
+    return result;
+}
+
+// acc = (sum of the partial match sums) / (sum of the counts), in every slot
+void merge_partials() {
+    controller.load_context(verbose);
+
+    Ctxt total;
+    int count = 0;
+    for (size_t i = 0; i < partial_paths.size(); i++) {
+        Ctxt partial = controller.load_ciphertext(partial_paths[i]);
+        int n = FHEController::read_partial_count(partial_paths[i]);
+        if (verbose) cout << "Partial " << partial_paths[i] << ": " << n << " samples" << endl;
+
+        total = i == 0 ? partial : controller.add(total, partial);
+        count += n;
+    }
+
+    cout << "Merged " << partial_paths.size() << " partials, " << count << " samples" << endl;
+
+    controller.save_partial(total, count, result_name + ".partial");
+
+    Ctxt acc_enc = controller.mult(total, 1.0 / count);
+    if (verbose) {
+        cout << "Approximate accuracy: " << controller.decrypt_tovector(acc_enc, 1)[0] << endl;
+    }
+    controller.save(acc_enc, result_name);
+}
+
 int main(int argc, char *argv[]) {
     setup_environment(argc, argv);
 
+    if (merge_mode) {
+        merge_partials();
+        return 0;
+    }
+
+    if (sign_table) {
+        FHEController::print_composite_sign_table();
+        return 0;
+    }
+
     cout << "\n[0/2] Loading context and encrypted weights..." << endl;
     controller.load_context(verbose);
     controller.load_bootstrapping_and_rotation_keys("rotation_keys.txt", 16384, verbose);
+    if (controller.sign_backend == SignBackend::SCHEME_SWITCH ||
+        (benchmark_sign && fs::exists(controller.parameters_folder + "/binfhe-context.txt"))) {
+        // The logits are 100 * logit: the precomputation takes the scale of the calibrated interval
+        controller.set_scheme_switch_bound(calibration.sign_bound);
+        controller.load_scheme_switching_keys(verbose);
+    }
 
     vector<double> labels = read_values_from_file(labels_file);
 
-    double min = -200.0;
-    double max = 200.0;
-    int degree = 25;
-
-    // curr. batch = 1
-    // SoonTM batch config
-    vector<Ctxt> batch_acc;
+    double min = -calibration.sign_bound;
+    double max = calibration.sign_bound;
+    int degree = calibration.sign_degree;
 
     cout << "\n[1/2] Load clfs logits and evaluate" << endl;
     std::vector<std::string> clf_encs_paths = getFilesSortedByNumber(input_path);
     int n = clf_encs_paths.size();
+    if (n == 0 || n > (int) labels.size()) {
+        cerr << n << " results in " << input_path << ", " << labels.size() << " labels in " << labels_file << endl;
+        exit(1);
+    }
 
-    vector<Ctxt> vec_c_neg;
-    vector<Ctxt> vec_c_pos;
-
-    for (int i = 0; i < n; i++) {
-        if (verbose) cout << "Processing " << clf_encs_paths[i] << endl;
-        Ctxt classified = controller.load_ciphertext(clf_encs_paths[i]); // have 2 levels
-        // out from zero — better sgn func approx (check notebook sign_approx.ipynb)
-        // logit 0.001 -> 0.1, etc
-        classified = controller.mult(classified, 100); // +1
-
-        vector<Ctxt> logits = controller.split_2_slots(classified); // +2 levels
-
-        vec_c_neg.push_back(logits[0]);
-        vec_c_pos.push_back(logits[1]);
+    // Blocks of at most one ciphertext of samples, evaluated independently (in parallel): their match
+    // sums are added homomorphically, as --merge does with the partials of separate runs
+    if (block_size <= 0 || block_size > controller.num_slots) block_size = controller.num_slots;
+    int blocks = (n + block_size - 1) / block_size;
+    if (block_workers <= 0) block_workers = std::min<int>(blocks, std::max(1u, thread::hardware_concurrency()));
+    // No concurrent use of the FHEW side of the context
+    if (controller.sign_backend == SignBackend::SCHEME_SWITCH) block_workers = 1;
+
+    if (load_workers <= 0) load_workers = std::max(1u, thread::hardware_concurrency());
+
+    if (benchmark_sign) {
+        int count = std::min(n, block_size);
+        if (blocks > 1) cout << "Sign benchmark on the first " << count << " samples" << endl;
+        auto [c_neg, c_pos] = load_blocks(clf_encs_paths, count, load_workers)[0];
+        benchmark_sign_backends(c_neg, c_pos, vector<double>(labels.begin(), labels.begin() + count), min, max, degree);
+        return 0;
     }
 
+    if (blocks > 1) cout << blocks << " blocks of " << block_size << " samples, " << block_workers << " in parallel" << endl;
 
-    if (verbose) cout << "Unwrapping" << endl;
-    Ctxt c_neg = controller.unwrap_vector_ctxts(vec_c_neg, n);
-    Ctxt c_pos = controller.unwrap_vector_ctxts(vec_c_pos, n);
+    auto start = start_time();
+    vector<pair<Ctxt, Ctxt>> block_logits = load_blocks(clf_encs_paths, n, load_workers);
+    if (verbose) print_duration(start, "Loading and packing " + to_string(n) + " results");
+    if (verbose) controller.print(block_logits[0].first, 128, "Negative Logits Vector");
 
-    // if (verbose) cout << "The evaluation of Pooler took: " << (duration_cast<milliseconds>(high_resolution_clock::now() - start)).count() / 1000.0 << " seconds." << endl;
-    if (verbose) controller.print(c_neg, 128, "Negative Logits Vector");
-    // c_neg = controller.mult(c_neg, 100);
-    // c_pos = controller.mult(c_pos, 100);
+    vector<Ctxt> matches(blocks);
+    vector<Ctxt> sums(blocks);
 
-    if (verbose) cout << "Accuracy measure" << endl;
-    Ctxt acc_enc = controller.accuracy(c_neg, c_pos, labels, min, max, degree); // +6 with degree=25 and +2 with mult
+    #pragma omp parallel for schedule(dynamic) num_threads(block_workers)
+    for (int b = 0; b < blocks; b++) {
+        int first = b * block_size;
+        int count = std::min(block_size, n - first);
+
+        vector<double> block_labels(labels.begin() + first, labels.begin() + first + count);
+        matches[b] = controller.accuracy(block_logits[b].first, block_logits[b].second, block_labels,
+                                         min, max, degree); // +6 with degree=25 and +2 with mult
+        sums[b] = controller.partial_state(matches[b], count);
+    }
 
-    if (verbose) controller.print(acc_enc, 128, "Accurasy Vector");
     double approx_acc = 0.0;
     if (verbose) {
-        // TODO: чтобы заменить это безобразие на более красивое решение
-        // нужно использовать rot_sum с операцией div на 0 слот
         cout << "--- Verbose ---" << endl;
-        vector<double> dec = controller.decrypt_tovector(acc_enc, n);
-        for (size_t i = 0; i < n; i++) {
-            dec[i] = round_01(dec[i]);
-            cout << dec[i] << " ";
-            approx_acc += dec[i];  // суммируем только первые n слотов
+        for (int b = 0; b < blocks; b++) {
+            int count = std::min(block_size, n - b * block_size);
+            vector<double> dec = controller.decrypt_tovector(matches[b], count);
+            for (int i = 0; i < count; i++) {
+                dec[i] = round_01(dec[i]);
+                if (blocks == 1) cout << dec[i] << " ";
+                approx_acc += dec[i];
+            }
         }
         approx_acc /= n;
         cout << "Approximate accuracy: " << approx_acc << endl;
     }
 
+    Ctxt total = blocks == 1 ? sums[0] : controller.add(sums);
+    // One block: the match vector as before. More: the mean in every slot, as --merge writes it
+    Ctxt acc_enc = blocks == 1 ? matches[0] : controller.mult(total, 1.0 / n);
+
     cout << "\n[2/2] Save" << endl;
+    // The accuracy leaves this repository (send_result in inference_batch.py): standard OpenFHE format
     controller.save(acc_enc, result_name);
+    // Input of benchmark_eval --merge
+    controller.save_partial(total, n, result_name + ".partial");
 
     return 0;
 }
@@ -133,11 +305,51 @@ int main(int argc, char *argv[]) {
 void setup_environment(int argc, char *argv[]) {
     string command;
 
+    // The table needs no context, keys or inputs
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--sign-table") {
+            sign_table = true;
+            return;
+        }
+    }
+
+    // --merge <result_name> <partial>...: only additions, no rotation keys needed
+    if (argc >= 4 && string(argv[1]) == "--merge") {
+        merge_mode = true;
+        result_name = argv[2];
+        for (int i = 3; i < argc; i++) {
+            if (string(argv[i]) == "--verbose") verbose = true;
+            else partial_paths.push_back(argv[i]);
+        }
+        if (partial_paths.empty()) {
+            cerr << "--merge needs at least one partial" << endl;
+            exit(1);
+        }
+        return;
+    }
+
     if (argc < 4) {
-        cout << "Usage: ./benchmark_eval <path_dir> <result_name> <labels_file> [OPTIONS]\n\n";
+        cout << "Usage: ./benchmark_eval <path_dir> <result_name> <labels_file> [OPTIONS]\n";
+        cout << "       ./benchmark_eval --merge <result_name> <partial>... [--verbose]\n\n";
+        cout << "Every run also writes <result_name>.partial (+ .count): the encrypted match sum of the batch.\n";
+        cout << "--merge adds the partials of many batches and divides by the total count.\n\n";
         cout << "Options:\n";
         cout << "  --verbose: Print detailed information, need private key\n";
-        cout << "  --plain: Compare with plain circuit\n\n";
+        cout << "  --plain: Compare with plain circuit\n";
+        cout << "  --sign=<chebyshev|composite|schemeswitch>: Sign used by the accuracy (default chebyshev)\n";
+        cout << "      schemeswitch compares exactly in FHEW, keys from encrypt_weights --scheme-switching\n";
+        cout << "      (FHEW at STD128, the CKKS side uses the HEStd_NotSet context: benchmark only)\n";
+        cout << "  --sign-margin=<x>: Composite sign, smallest |100 * (neg - pos)| to classify (default 1)\n";
+        cout << "  --sign-precision=<bits>: Composite sign precision (default 4)\n";
+        cout << "  --sign-table: Print the composite sign depth/precision table and exit\n";
+        cout << "  --odd-sign: Chebyshev sign as x * g(x^2) (half the Chebyshev basis, one more level)\n";
+        cout << "  --benchmark-sign: Time the accuracy with every sign backend, no result is saved\n";
+        cout << "  --block-size <n>: Samples per ciphertext block (default and maximum: the slot count).\n";
+        cout << "      With more than one block the result holds the mean accuracy in every slot, like --merge\n";
+        cout << "  --block-workers <n>: Blocks evaluated in parallel (default min(blocks, cores))\n";
+        cout << "  --load-workers <n>: Threads loading and packing the result files (default cores)\n";
+        cout << "  --calibration <file>: Sign interval and degree from calibrate.py (default [-200, 200], 25),\n";
+        cout << "      the interval also sets the scale of --sign=schemeswitch\n\n";
         cout << "Example:\n";
         cout << "  ./client_inference \"I think this movie is great!\" --verbose\n";
         exit(0);
@@ -153,6 +365,39 @@ void setup_environment(int argc, char *argv[]) {
             if (string(argv[i]) == "--plain") {
                 plain = true;
             }
+            if (string(argv[i]) == "--sign=composite") {
+                controller.sign_backend = SignBackend::COMPOSITE;
+            }
+            if (string(argv[i]) == "--sign=schemeswitch") {
+                controller.sign_backend = SignBackend::SCHEME_SWITCH;
+            }
+            if (string(argv[i]) == "--block-size" && i + 1 < argc) {
+                block_size = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--load-workers" && i + 1 < argc) {
+                load_workers = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--block-workers" && i + 1 < argc) {
+                block_workers = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--calibration" && i + 1 < argc) {
+                calibration = Calibration::load(argv[++i]);
+            }
+            if (string(argv[i]) == "--benchmark-sign") {
+                benchmark_sign = true;
+            }
+            if (string(argv[i]) == "--odd-sign") {
+                controller.sign_odd = true;
+            }
+            if (string(argv[i]) == "--sign=chebyshev") {
+                controller.sign_backend = SignBackend::CHEBYSHEV;
+            }
+            if (string(argv[i]).rfind("--sign-margin=", 0) == 0) {
+                controller.sign_margin = stod(string(argv[i]).substr(14));
+            }
+            if (string(argv[i]).rfind("--sign-precision=", 0) == 0) {
+                controller.sign_precision = stoi(string(argv[i]).substr(17));
+            }
         }
     }
 }
@@ -2,6 +2,8 @@
 #include "FHEController.h"
 #include <chrono>
 #include <filesystem>
+#include "StageCache.h"
+#include "Calibration.h"
 
 #define GREEN_TEXT "\033[1;32m"
 #define RED_TEXT "\033[1;31m"
@@ -21,6 +23,9 @@ Ctxt classifier(Ctxt input);
 
 bool verbose = false;
 bool plain = false;
+int precompute_zeros = 0; // --precompute-zeros: offline phase only
+bool zero_pool = false;   // --zero-pool: online encryption with a precomputed zero
+Calibration calibration;  // --calibration: tanh scale and degree (calibrate.py), as client_inference_batch
 // bool demo = false;
 string text;
 string input_path;
@@ -32,9 +37,20 @@ int main(int argc, char *argv[]) {
     // Load context and keys
     cout << "\n[0/2] Loading context and encrypted weights..." << endl;
     controller.load_context(verbose);
+
+    // Offline phase: only the public key is needed
+    if (precompute_zeros > 0) {
+        controller.precompute_zeros(controller.parameters_folder + "/zero_pool", precompute_zeros);
+        cout << precompute_zeros << " encryptions of zero written to " << controller.parameters_folder << "/zero_pool" << endl;
+        return 0;
+    }
+
     controller.load_bootstrapping_and_rotation_keys("rotation_keys.txt", 16384, verbose);
 
-    system("mkdir checkpoint 2>nul");
+    // Pooler output of this input/weights/keys, reused by a rerun
+    StageCache cache("checkpoint", "client_inference;calibration=" + calibration.describe());
+    cache.add_manifest(controller.parameters_folder);
+    cache.add_manifest("encrypted_weights");
 
     if (verbose) cout << "\nSERVER-SIDE\nThe evaluation of the circuit started." << endl;
 
@@ -43,12 +59,21 @@ int main(int argc, char *argv[]) {
     // Ptxt plain_input;
     // if (demo) plain_input = controller.read_plain_input(input_path);
     // else plain_input = controller.read_plain_input(input_path);
-    Ptxt plain_input = controller.read_plain_input(input_path);
-    Ctxt encrypted_input = controller.encrypt_ptxt(plain_input);
+    uint64_t digest = StageCache::digest_files({input_path});
+    Ctxt pooled;
 
-    cout << "[1/2] Running Pooler..." << endl;
-    Ctxt pooled = pooler(encrypted_input);
-    controller.save(pooled, "checkpoint/pooled.bin");
+    if (cache.contains(digest, "pooled")) {
+        cout << "[1/2] Pooler output found in checkpoint/" << endl;
+        pooled = cache.load(controller, digest, "pooled");
+    } else {
+        Ptxt plain_input = controller.read_plain_input(input_path);
+        Ctxt encrypted_input = zero_pool ? controller.encrypt_from_pool(plain_input, controller.parameters_folder + "/zero_pool")
+                                         : controller.encrypt_ptxt(plain_input);
+
+        cout << "[1/2] Running Pooler..." << endl;
+        pooled = pooler(encrypted_input);
+        cache.store(controller, digest, "pooled", pooled);
+    }
 
     cout << "[2/2] Running Classifier..." << endl;
     Ctxt classified = classifier(pooled);
@@ -85,9 +110,7 @@ Ctxt classifier(Ctxt input) {
     Ctxt weight = controller.load_ciphertext("encrypted_weights/classifier_weight.txt.enc");
     Ctxt bias = controller.load_ciphertext("encrypted_weights/classifier_bias.txt.enc");
 
-    Ctxt output = controller.mult(input, weight);
-    output = controller.rotsum(output, 128, 1);
-    output = controller.add(output, bias);
+    Ctxt output = controller.dot_product({input}, {weight}, 128, 1, bias);
 
     vector<double> mask;
     for (int i = 0; i < controller.num_slots; i++) {
@@ -108,11 +131,9 @@ Ctxt pooler(Ctxt input) {
     Ctxt weight_enc = controller.load_ciphertext("encrypted_weights/pooler_dense_weight.txt.enc");
     Ctxt bias_enc = controller.load_ciphertext("encrypted_weights/pooler_dense_bias.txt.enc");
 
-    Ctxt output = controller.mult(weight_enc, input);
-
-    output = controller.rotsum(output, 128, 128);
-    output = controller.add(output, bias_enc);
-    output = controller.eval_tanh_function(output, -30, 30, 50); // 7 mult. depth
+    // The weights are already multiplied by tanh_scale (encrypt_weights --calibration)
+    Ctxt output = controller.dot_product({input}, {weight_enc}, 128, 128, bias_enc);
+    output = controller.eval_tanh_function(output, -1, 1, calibration.tanh_scale, calibration.tanh_degree);
     output = controller.bootstrap(output);
 
     if (verbose) cout << "The evaluation of Pooler took: " << (duration_cast<milliseconds>(high_resolution_clock::now() - start)).count() / 1000.0 << " seconds." << endl;
@@ -128,12 +149,22 @@ void setup_environment(int argc, char *argv[]) {
     //     demo = true;
     //     return;
     // }
+    if (argc >= 3 && string(argv[1]) == "--precompute-zeros") {
+        precompute_zeros = stoi(argv[2]);
+        return;
+    }
+
     if (argc < 3) {
-        cout << "Usage: ./client_inference <path_input> <result_output> [OPTIONS]\n\n";
+        cout << "Usage: ./client_inference <path_input> <result_output> [OPTIONS]\n";
+        cout << "       ./client_inference --precompute-zeros <n>\n\n";
         cout << "Options:\n";
         cout << "  --verbose: Print detailed information, need private key\n";
-        cout << "  --plain: Compare with plain circuit\n\n";
+        cout << "  --plain: Compare with plain circuit\n";
+        cout << "  --calibration <file>: tanh scale and degree from calibrate.py, the same file as encrypt_weights\n\n";
         cout << "  --demo: continue with inference 'It's a good film'\n\n";
+        cout << "  --zero-pool: Encrypt the input with a zero from --precompute-zeros (encode + add)\n";
+        cout << "  --precompute-zeros <n>: Write n public-key encryptions of zero to <keys>/zero_pool and exit,\n";
+        cout << "             each one is used by a single --zero-pool run\n\n";
         cout << "Example:\n";
         cout << "  ./client_inference \"I think this movie is great!\" --verbose\n";
         // TODO: upd example in usage cout
@@ -149,6 +180,12 @@ void setup_environment(int argc, char *argv[]) {
             if (string(argv[i]) == "--plain") {
                 plain = true;
             }
+            if (string(argv[i]) == "--zero-pool") {
+                zero_pool = true;
+            }
+            if (string(argv[i]) == "--calibration" && i + 1 < argc) {
+                calibration = Calibration::load(argv[++i]);
+            }
         }
     }
 }
@@ -2,6 +2,15 @@
 #include "FHEController.h"
 #include <chrono>
 #include <filesystem>
+#include <thread>
+#include <sstream>
+#include <fstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <omp.h>
+#include "BoundedQueue.h"
+#include "StageCache.h"
+#include "Calibration.h"
 
 #define GREEN_TEXT "\033[1;32m"
 #define RED_TEXT "\033[1;31m"
@@ -14,13 +23,60 @@ FHEController controller;
 
 void setup_environment(int argc, char *argv[]);
 
-vector<Ctxt> encoder1(string input_folder);
+struct Sample {
+    int index;
+    uint64_t digest;      // StageCache key of the input
+    vector<Ctxt> inputs;  // empty when the cache already has the pooled/classified result
+};
+
+void fork_into_workers(int &first, int &end);
+int count_samples();
+vector<string> sample_files(int i);
+string input_file(const string &plain_file);
+Ctxt load_input(const string &file, bool expanded);
+vector<Ctxt> load_sample(const vector<string> &files, const string &prefix);
+bool read_record(istream &in, vector<double> &values);
+vector<Ctxt> encrypt_record(const vector<double> &values);
+void write_result(ostream &out, int index, const Ctxt &result);
+void evaluate_block(LogitAccumulator &logits, int first);
+void save_evaluation();
+vector<Ctxt> encoder1(const vector<Ctxt> &inputs);
 Ctxt encoder2(vector<Ctxt> input);
+string encoder_mode();
+void compare_with_reference(const Ctxt &cls, int i);
+Ctxt encoder_layer(const vector<Ctxt> &inputs, int layer, double gelu_scale);
+Ctxt layernorm(const Ctxt &input, const string &prefix, int layer, int inputs_count);
+Ctxt ensure_levels(const Ctxt &c, int levels);
+void report_layer_time(const string &name, chrono::time_point<steady_clock, nanoseconds> start);
 Ctxt pooler(Ctxt input);
 Ctxt classifier(Ctxt input);
+Ctxt pooler_bsgs(Ctxt input);
+Ctxt pooler_output(const Ctxt &activated);
+void check_head_level(const Ctxt &input, const Ctxt &weight);
+Ctxt classifier_bsgs(Ctxt input);
 
 bool verbose = false;
 bool plain = false;
+bool bsgs = false;
+bool encoder = false;
+bool exact_layernorm = false;
+double layer_budget = 0; // seconds, 0 = no budget
+int prefetch = 2;        // samples loaded ahead / results waiting to be written
+bool stream = false;
+string stream_source = "-"; // "-" = stdin
+string cache_folder;          // --cache, empty = no cache
+int range_first = 0;          // --range: samples [range_first, range_first + range_count), res_i keep global indices
+int range_count = -1;         // -1 = up to the last sample
+int fork_workers = 1;         // --fork-workers: processes sharing the loaded keys (copy-on-write)
+int encoder_workers = 4;      // --encoder-workers: outer threads over tokens/heads/containers, 1 = sequential
+int zero_pool = 0;            // --zero-pool: encryptions of zero kept ready by a background thread
+bool fused_head = false;      // --fused-head: pooler + classifier without the pooler bootstrap when the levels allow it
+bool raw_results = false;     // --raw-results: res_i in the raw format (benchmark_eval reads both)
+int head_reserve = -1;        // --head-reserve: levels left to the evaluation of the logits, -1 = what benchmark_eval needs
+Calibration calibration;      // --calibration: tanh/GELU scales and degrees, softmax/LayerNorm ranges, sign interval (calibrate.py)
+string evaluate_labels;       // --evaluate <labels_file> <result_name>: accuracy in this process, no res_i files
+string evaluate_result;
+StageCache cache;
 // bool demo = false;
 string text;
 string input_folder;
@@ -29,6 +85,16 @@ string output_folder;
 int main(int argc, char *argv[]) {
     setup_environment(argc, argv);
 
+    // stdout carries the results in stream mode: every log line goes to stderr
+    streambuf *stdout_buffer = cout.rdbuf();
+    ostream result_stream(stdout_buffer);
+    if (stream) cout.rdbuf(cerr.rdbuf());
+
+    // --fork-workers: the OpenMP pool must not exist at the fork (libgomp threads do not survive it),
+    // so the parent loads single-threaded and every worker gets its share of the cores afterwards
+    int threads = omp_get_max_threads();
+    if (fork_workers > 1) omp_set_num_threads(1);
+
     // Load context and keys
     cout << "\n[0/2] Loading context and encrypted weights..." << endl;
     controller.load_context(verbose);
@@ -36,25 +102,149 @@ int main(int argc, char *argv[]) {
 
     if (verbose) cout << "The evaluation of the circuit started." << endl;
 
-    // get folder size
-    fs::path path(input_folder);
-    fs::directory_iterator it(path), endit;
-    int folder_size = 0;
-    for (; it != endit; ++it) folder_size++;
+    if (!cache_folder.empty()) {
+        // Everything that changes the ciphertexts of a stage, besides the input and the weights
+        string parameters = "bsgs=" + to_string(bsgs) + ";encoder=" + to_string(encoder) +
+                            ";exact_layernorm=" + to_string(exact_layernorm) +
+                            ";softmax_r=" + to_string(controller.softmax_r) +
+                            ";fused_head=" + to_string(fused_head) +
+                            ";tanh_odd=" + to_string(controller.tanh_odd) +
+                            ";calibration=" + calibration.describe();
+        cache = StageCache(cache_folder, parameters);
+        cache.add_manifest(controller.parameters_folder);
+        cache.add_manifest("encrypted_weights");
+    }
+
+    int folder_size = stream ? 0 : count_samples();
+    string total = stream ? "?" : to_string(folder_size);
+    int range_end = range_count < 0 ? folder_size : min(folder_size, range_first + range_count);
+
+    // The keys are loaded once above: the forked workers map the same pages until they write them
+    if (fork_workers > 1) {
+        fork_into_workers(range_first, range_end);
+        omp_set_num_threads(max(1, threads / fork_workers));
+    }
+
+    // Encoder: encoder_workers threads over the independent ciphertexts, each one with a nested team
+    // of the cores left (FHEController::nested_threads); never more than two active levels
+    controller.ciphertext_workers = max(1, encoder_workers);
+    omp_set_max_active_levels(controller.ciphertext_workers > 1 ? 2 : 1);
+
+    int stages = encoder ? 4 : 2;
+
+    // After the fork: each worker refills its own pool. The loader then only encodes and adds
+    if (zero_pool > 0) controller.start_zero_pool(zero_pool);
+
+    // Pipeline: the loader reads/encodes/encrypts sample i + 1 while sample i is evaluated,
+    // the writer serializes finished results. Single consumer per queue, so res_i keep their order
+    BoundedQueue<Sample> inputs(prefetch);
+    BoundedQueue<pair<int, Ctxt>> results(prefetch);
+
+    thread loader([&]() {
+        if (stream) {
+            ifstream pipe;
+            if (stream_source != "-") pipe.open(stream_source, ios::in | ios::binary);
+            istream &in = stream_source == "-" ? cin : pipe;
+            if (!in) {
+                cerr << "Cannot open the stream \"" << stream_source << "\"" << endl;
+                exit(1);
+            }
+
+            vector<double> values;
+            for (int i = 0; read_record(in, values); i++) {
+                uint64_t digest = cache.active() ? StageCache::digest_values(values) : 0;
+                if (cache.contains(digest, "pooled") || cache.contains(digest, "classified")) {
+                    inputs.push({i, digest, {}});
+                    continue;
+                }
+                cout << "[" << i + 1 << "/?] [0/" << stages << "] Encrypting record (" << values.size() << " values)..." << endl;
+                inputs.push({i, digest, encrypt_record(values)});
+            }
+        } else {
+            for (int i = range_first; i < range_end; i++) {
+                vector<string> files = sample_files(i);
+                uint64_t digest = cache.active() ? StageCache::digest_files(files) : 0;
+                if (cache.contains(digest, "pooled") || cache.contains(digest, "classified")) {
+                    inputs.push({i, digest, {}});
+                    continue;
+                }
+                string prefix = "[" + to_string(i + 1) + "/" + total + "] [0/" + to_string(stages) + "] ";
+                inputs.push({i, digest, load_sample(files, prefix)});
+            }
+        }
+        inputs.close();
+    });
+
+    thread writer([&]() {
+        pair<int, Ctxt> result;
+        while (results.pop(result)) {
+            if (stream) {
+                write_result(result_stream, result.first, result.second);
+                continue;
+            }
+            // dump clf-encrypted. Written to .tmp and renamed, as StageCache::store: a worker killed while
+            // writing leaves no truncated res_i, the coordinator then sees the shard as incomplete
+            string output_file = output_folder + "/res_" + to_string(result.first) + ".txt.enc";
+            if (raw_results) controller.save_raw(result.second, output_file + ".tmp");
+            else controller.save(result.second, output_file + ".tmp");
+            fs::rename(output_file + ".tmp", output_file);
+        }
+    });
+
+    // --evaluate: the logits go into the accumulators instead of the writer, a full block is evaluated
+    // right away (labels of samples evaluated_first...)
+    LogitAccumulator logits;
+    int evaluated_first = range_first;
+    auto deliver = [&](int i, const Ctxt &classified) {
+        if (evaluate_labels.empty()) {
+            results.push({i, classified});
+            return;
+        }
+        controller.accumulate_logits(logits, classified, 100);
+        if (logits.count == controller.num_slots) {
+            evaluate_block(logits, evaluated_first);
+            evaluated_first += controller.num_slots;
+        }
+    };
+
+    Sample sample;
+    while (inputs.pop(sample)) {
+        int i = sample.index;
+        string prefix = "[" + to_string(i + 1) + "/" + total + "] ";
 
-    for (int i = 0; i < folder_size; i++) {
-        string input_file = input_folder + "/" + input_folder + "_" + to_string(i) + ".txt";
-        cout << "[" << i + 1 << "/" << folder_size << "] [0/2] Loading input from " << input_file << "..." << endl;
+        if (cache.contains(sample.digest, "classified")) {
+            cout << prefix << "Classified logits found in the cache, skipping" << endl;
+            deliver(i, cache.load(controller, sample.digest, "classified"));
+            continue;
+        }
+
+        Ctxt pooled;
+        if (cache.contains(sample.digest, "pooled")) {
+            cout << prefix << "[" << stages - 1 << "/" << stages << "] Pooler output found in the cache" << endl;
+            pooled = cache.load(controller, sample.digest, "pooled");
+        } else {
+            Ctxt encrypted_input;
 
-        Ptxt plain_input = controller.read_plain_repeated_input(input_file);
-        // vector<double> vector_input = read_values_from_file(input_file);
-        Ctxt encrypted_input = controller.encrypt_ptxt(plain_input);
+            if (encoder) {
+                cout << prefix << "[1/" << stages << "] Running Encoder 1..." << endl;
+                vector<Ctxt> hidden = encoder1(sample.inputs);
 
-        cout << "[" << i + 1 << "/" << folder_size << "] [1/2] Running Pooler..." << endl;
-        Ctxt pooled = pooler(encrypted_input);
+                cout << prefix << "[2/" << stages << "] Running Encoder 2..." << endl;
+                encrypted_input = encoder2(hidden);
 
-        cout << "[" << i + 1 << "/" << folder_size << "] [2/2] Running Classifier..." << endl;
-        Ctxt classified = classifier(pooled);
+                if (plain && !stream) compare_with_reference(encrypted_input, i);
+            } else {
+                encrypted_input = sample.inputs[0];
+            }
+
+            cout << prefix << "[" << stages - 1 << "/" << stages << "] Running Pooler..." << endl;
+            pooled = bsgs ? pooler_bsgs(encrypted_input) : pooler(encrypted_input);
+            cache.store(controller, sample.digest, "pooled", pooled);
+        }
+
+        cout << prefix << "[" << stages << "/" << stages << "] Running Classifier..." << endl;
+        Ctxt classified = bsgs ? classifier_bsgs(pooled) : classifier(pooled);
+        cache.store(controller, sample.digest, "classified", classified);
 
         if (verbose) cout << "The circuit has been evaluated, the results are sent back to the client" << endl << endl;
         if (verbose) cout << "CLIENT-SIDE" << endl;
@@ -62,21 +252,479 @@ int main(int argc, char *argv[]) {
         if (verbose)
             controller.print(classified, 2, "Output logits");
 
-        // dump clf-encrypted
-        string output_file = output_folder + "/res_" + to_string(i) + ".txt.enc";
-        controller.save(classified, output_file);
+        deliver(i, classified);
+    }
+
+    results.close();
+    loader.join();
+    writer.join();
+    controller.stop_zero_pool();
+
+    if (!evaluate_labels.empty()) {
+        if (logits.count > 0) evaluate_block(logits, evaluated_first);
+        save_evaluation();
     }
+
+    cout.rdbuf(stdout_buffer);
+
     return 0;
 }
 
+// End-to-end mode: same accuracy and outputs as benchmark_eval on the res_i files, without writing,
+// reloading and unwrapping them. Blocks of num_slots samples, their match sums are added up
+vector<Ctxt> block_matches;
+vector<Ctxt> block_sums;
+int evaluated = 0;
+
+// first: index in the labels file of the first sample of the block (--range)
+void evaluate_block(LogitAccumulator &logits, int first) {
+    int n = logits.count;
+    static vector<double> labels = read_values_from_file(evaluate_labels);
+    if (first + n > (int) labels.size()) {
+        cerr << first + n << " samples evaluated, " << labels.size() << " labels in " << evaluate_labels << endl;
+        exit(1);
+    }
+
+    cout << "Accuracy of samples " << first << ".." << first + n - 1 << "..." << endl;
+    auto [c_neg, c_pos] = controller.accumulated_logits(logits);
+    // Same sign interval and degree as benchmark_eval
+    Ctxt match = controller.accuracy(c_neg, c_pos, vector<double>(labels.begin() + first, labels.begin() + first + n),
+                                     -calibration.sign_bound, calibration.sign_bound, calibration.sign_degree);
+
+    if (verbose) {
+        vector<double> dec = controller.decrypt_tovector(match, n);
+        int correct = 0;
+        for (int i = 0; i < n; i++) correct += dec[i] >= 0.5;
+        cout << "Approximate accuracy of the block: " << (double) correct / n << endl;
+    }
+
+    block_matches.push_back(match);
+    block_sums.push_back(controller.partial_state(match, n));
+    evaluated += n;
+    logits = LogitAccumulator();
+}
+
+// As benchmark_eval: the result leaves the repository in the standard OpenFHE format (the match vector,
+// or the mean in every slot for more than one block), + the partial for --merge
+void save_evaluation() {
+    if (evaluated == 0) {
+        cerr << "No sample evaluated" << endl;
+        exit(1);
+    }
+
+    Ctxt total = block_sums.size() == 1 ? block_sums[0] : controller.add(block_sums);
+    Ctxt acc_enc = block_matches.size() == 1 ? block_matches[0] : controller.mult(total, 1.0 / evaluated);
+
+    controller.save(acc_enc, evaluate_result);
+    controller.save_partial(total, evaluated, evaluate_result + ".partial");
+}
+
+/*
+ * --fork-workers: one process loads the context, mult/rotation/bootstrapping keys, then forks.
+ * Evaluation only reads the key material, so its pages stay shared copy-on-write between the
+ * workers instead of one private copy of several GB per process (no shared memory segment: the
+ * OpenFHE keys are heap objects, only fork can share them as they are). Each worker runs the usual
+ * pipeline on a contiguous part of the samples. Nothing may run threads before the fork: the loader,
+ * writer and zero pool threads start after it, and main() loads the keys with one OpenMP thread.
+ */
+// Parent: waits for the workers and exits (1 if one of them failed). Child: returns with its part of [first, end)
+void fork_into_workers(int &first, int &end) {
+    int n = end - first;
+    vector<pid_t> children;
+
+    for (int w = 0; w < fork_workers; w++) {
+        int a = first + n * w / fork_workers;
+        int b = first + n * (w + 1) / fork_workers;
+        if (a == b) continue;
+
+        cout.flush();
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "fork failed, " << children.size() << " workers started" << endl;
+            exit(1);
+        }
+        if (pid == 0) {
+            first = a;
+            end = b;
+            return;
+        }
+
+        children.push_back(pid);
+        cout << "Worker " << pid << ": samples " << a << ".." << b - 1 << endl;
+    }
+
+    int failed = 0;
+    for (pid_t pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            cerr << "Worker " << pid << " failed" << endl;
+            failed++;
+        }
+    }
+
+    exit(failed > 0 ? 1 : 0);
+}
+
+// Samples are <input_folder>/<input_folder>_0.txt, _1.txt, ... (folders _0, _1, ... with --encoder),
+// counted up to the first missing index: other files in the folder are ignored.
+// An input may also be uploaded already encrypted as <name>.txt.enc (encrypt_weights --seeded-inputs)
+int count_samples() {
+    int count = 0;
+    while (true) {
+        string sample = input_folder + "/" + input_folder + "_" + to_string(count);
+        if (encoder ? !fs::is_directory(sample) : input_file(sample + ".txt").empty()) break;
+        count++;
+    }
+
+    if (count == 0) {
+        cerr << "No samples found in \"" << input_folder << "\"" << endl;
+        exit(1);
+    }
+
+    return count;
+}
+
+// Input files of the i-th sample: the [CLS] embedding, or <input_folder>_i/input_<token>.txt for --encoder
+vector<string> sample_files(int i) {
+    if (!encoder) return {input_file(input_folder + "/" + input_folder + "_" + to_string(i) + ".txt")};
+
+    string sample_folder = input_folder + "/" + input_folder + "_" + to_string(i);
+
+    vector<string> files;
+    for (int t = 0;; t++) {
+        string file = input_file(sample_folder + "/input_" + to_string(t) + ".txt");
+        if (file.empty()) break;
+        files.push_back(file);
+    }
+
+    // matmulScores/softmax keep the scores of a head in 64 slots
+    if (files.empty() || files.size() > 64) {
+        cerr << "Expected 1 to 64 token embeddings in \"" << sample_folder << "\", found " << files.size() << endl;
+        exit(1);
+    }
+
+    return files;
+}
+
+// The encrypted upload when there is one, then the plain file, "" if neither exists
+string input_file(const string &plain_file) {
+    if (fs::is_regular_file(plain_file + ".enc")) return plain_file + ".enc";
+    if (fs::is_regular_file(plain_file)) return plain_file;
+    return "";
+}
+
+// Seeded uploads are expanded by load_ciphertext
+Ctxt load_input(const string &file, bool expanded) {
+    if (fs::path(file).extension() == ".enc") return controller.load_ciphertext(file);
+
+    return controller.encrypt_pooled(expanded ? controller.read_plain_expanded_input(file)
+                                              : controller.read_plain_repeated_input(file));
+}
+
+// Encrypted input(s) of a sample: the token embeddings for --encoder, the [CLS] embedding otherwise
+vector<Ctxt> load_sample(const vector<string> &files, const string &prefix) {
+    if (!encoder) {
+        cout << prefix << "Loading input from " << files[0] << "..." << endl;
+
+        return {load_input(files[0], false)};
+    }
+
+    cout << prefix << "Loading " << files.size() << " token embeddings from " << fs::path(files[0]).parent_path() << "..." << endl;
+
+    vector<Ctxt> inputs;
+    for (const string &file : files) {
+        inputs.push_back(load_input(file, true));
+    }
+
+    return inputs;
+}
+
+// Stream record: uint32 count, then count float64 (native byte order). False on a clean EOF
+bool read_record(istream &in, vector<double> &values) {
+    uint32_t count;
+    if (!in.read(reinterpret_cast<char *>(&count), sizeof(count))) {
+        if (in.gcount() == 0) return false;
+        cerr << "Truncated record header in the stream" << endl;
+        exit(1);
+    }
+
+    values.resize(count);
+    if (!in.read(reinterpret_cast<char *>(values.data()), count * sizeof(double))) {
+        cerr << "Truncated record in the stream: expected " << count << " values" << endl;
+        exit(1);
+    }
+
+    return true;
+}
+
+// Same layouts as load_sample: one [CLS] embedding (128 values), or 128 values per token with --encoder
+vector<Ctxt> encrypt_record(const vector<double> &values) {
+    int tokens = values.size() / 128;
+    if (values.size() % 128 != 0 || tokens == 0 || tokens > (encoder ? 64 : 1)) {
+        cerr << "Expected " << (encoder ? "1 to 64 token embeddings of 128 values" : "128 values")
+             << " in a record, got " << values.size() << endl;
+        exit(1);
+    }
+
+    if (!encoder) return {controller.encrypt_pooled(controller.encode_repeated(values.data()))};
+
+    vector<Ctxt> inputs;
+    for (int t = 0; t < tokens; t++) {
+        inputs.push_back(controller.encrypt_pooled(controller.encode_expanded(values.data() + 128 * t)));
+    }
+
+    return inputs;
+}
+
+// Stream result: uint32 sample index, uint64 size, serialized ciphertext
+void write_result(ostream &out, int index, const Ctxt &result) {
+    ostringstream serialized;
+    Serial::Serialize(result, serialized, SerType::BINARY);
+    string bytes = serialized.str();
+
+    uint32_t sample = index;
+    uint64_t size = bytes.size();
+    out.write(reinterpret_cast<const char *>(&sample), sizeof(sample));
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.write(bytes.data(), bytes.size());
+    out.flush();
+}
+
+/*
+ * Encoder layers (TinyBERT layer 0 and layer 1), weights from encrypt_weights --encoder.
+ * Layouts: "expanded" = one ciphertext per token, feature j in slots 128j..128j+127;
+ * "wrapped" = all the tokens in one ciphertext, feature j of token i in slot 128j + i.
+ * The two attention heads are packed in the same ciphertexts (64 slots each). Tokens, score rows
+ * and GELU containers are independent: --encoder-workers threads evaluate them in parallel, the
+ * remaining cores parallelise inside every OpenFHE operation. --encoder-workers 1 = sequential.
+ */
+// Label of the per-layer timings, to compare the two modes
+string encoder_mode() {
+    if (controller.ciphertext_workers <= 1) return "sequential";
+    return to_string(controller.ciphertext_workers) + " workers x " + to_string(controller.nested_threads()) + " threads";
+}
+
+vector<Ctxt> encoder1(const vector<Ctxt> &inputs) {
+    auto start = start_time();
+    int inputs_count = inputs.size();
+
+    Ctxt output = encoder_layer(inputs, 0, calibration.gelu_scale[0]);
+
+    vector<Ctxt> unwrapped = controller.unwrapExpanded(output, inputs_count);
+    report_layer_time("Encoder 1 (" + to_string(inputs_count) + " tokens, " + encoder_mode() + ")", start);
+
+    return unwrapped;
+}
+
+Ctxt encoder2(vector<Ctxt> input) {
+    auto start = start_time();
+
+    Ctxt output = encoder_layer(input, 1, calibration.gelu_scale[1]);
+
+    // Only the [CLS] token goes to the pooler, in the expanded layout
+    output = controller.unwrapExpanded(output, 1)[0];
+    report_layer_time("Encoder 2 (" + encoder_mode() + ")", start);
+
+    if (verbose) controller.print_expanded(output, 128, 128, "Encoder 2 [CLS] (Expanded)");
+
+    return output;
+}
+
+// --plain: the decrypted [CLS] against TinyBertPartial on the same tokens (inference_batch.py, reference.txt)
+void compare_with_reference(const Ctxt &cls, int i) {
+    string file = input_folder + "/" + input_folder + "_" + to_string(i) + "/reference.txt";
+    vector<double> reference = read_values_from_file(file);
+    if (reference.size() != 128) {
+        cerr << "No plain [CLS] reference in \"" << file << "\", skipping the comparison" << endl;
+        return;
+    }
+
+    vector<double> decrypted = controller.decrypt_tovector(cls, controller.num_slots);
+
+    double max_error = 0;
+    for (int j = 0; j < 128; j++) {
+        max_error = max(max_error, abs(decrypted[128 * j] - reference[j]));
+    }
+
+    cout << (max_error < 0.1 ? GREEN_TEXT : RED_TEXT) << "Encoder 2 [CLS] vs plain TinyBertPartial: max |diff| = "
+         << max_error << RESET_COLOR << endl;
+}
+
+// One encoder layer: inputs are expanded, the result is wrapped
+Ctxt encoder_layer(const vector<Ctxt> &inputs, int layer, double gelu_scale) {
+    string prefix = "encrypted_weights/layer" + to_string(layer) + "_";
+    int inputs_count = inputs.size();
+    auto start = start_time();
+
+    // ───── Self-attention ─────
+    Ctxt query_w = controller.load_ciphertext(prefix + "attself_query_weight.txt.enc");
+    Ctxt query_b = controller.load_ciphertext(prefix + "attself_query_bias.txt.enc");
+    Ctxt key_w = controller.load_ciphertext(prefix + "attself_key_weight.txt.enc");
+    Ctxt key_b = controller.load_ciphertext(prefix + "attself_key_bias.txt.enc");
+    Ctxt value_w = controller.load_ciphertext(prefix + "attself_value_weight.txt.enc");
+    Ctxt value_b = controller.load_ciphertext(prefix + "attself_value_bias.txt.enc");
+
+    vector<Ctxt> Q = controller.matmulRE(inputs, query_w, query_b);
+    vector<Ctxt> K = controller.matmulRE(inputs, key_w, key_b);
+    vector<Ctxt> V = controller.matmulRE(inputs, value_w, value_b);
+
+    Ctxt K_wrapped = controller.wrapUpRepeated(K);
+    Ctxt V_wrapped = controller.wrapUpRepeated(V);
+
+    Ctxt scores = controller.matmulScores(Q, K_wrapped);
+    // Range of the row sums of exp(scores) from calibrate.py
+    scores = controller.softmax(scores, inputs_count, calibration.softmax_sum_min[layer], calibration.softmax_sum_max[layer]);
+
+    // Probabilities, in [0, 1]. Unwrap, attention output, dense and wrap need 4 levels
+    scores = ensure_levels(scores, 4);
+
+    vector<Ctxt> unwrapped_scores = controller.unwrapScoresExpanded(scores, inputs_count);
+
+    // Attention output: the sum over the keys is a rotsum over the 128-slot blocks
+    vector<Ctxt> output = controller.matmulRE(unwrapped_scores, V_wrapped, 128, 128);
+
+    if (verbose) print_duration(start, "Layer " + to_string(layer) + " self-attention");
+    start = start_time();
+
+    Ctxt dense_w = controller.load_ciphertext(prefix + "selfoutput_weight.txt.enc");
+    Ctxt dense_b = controller.load_ciphertext(prefix + "selfoutput_bias.txt.enc");
+
+    output = controller.matmulCR(output, dense_w, dense_b);
+
+    // Residual connection
+    for (int i = 0; i < inputs_count; i++) {
+        controller.add_inplace(output[i], inputs[i]);
+    }
+
+    Ctxt wrapped_output = controller.wrapUpExpanded(output);
+    wrapped_output = controller.bootstrap(wrapped_output);
+    wrapped_output = layernorm(wrapped_output, prefix + "selfoutput", layer, inputs_count);
+
+    if (verbose) print_duration(start, "Layer " + to_string(layer) + " self-output");
+    start = start_time();
+
+    // ───── Feed forward: 128 → 512 (GELU) → 128 ─────
+    vector<Ctxt> intermediate_w;
+    vector<Ctxt> output_w;
+    for (int i = 1; i <= 4; i++) {
+        intermediate_w.push_back(controller.load_ciphertext(prefix + "intermediate_weight" + to_string(i) + ".txt.enc"));
+        output_w.push_back(controller.load_ciphertext(prefix + "output_weight" + to_string(i) + ".txt.enc"));
+    }
+    Ctxt intermediate_b = controller.load_ciphertext(prefix + "intermediate_bias.txt.enc");
+    Ctxt output_b = controller.load_ciphertext(prefix + "output_bias.txt.enc");
+
+    output = controller.unwrapExpanded(wrapped_output, inputs_count);
+    output = controller.matmulRElarge(output, intermediate_w, intermediate_b);
+
+    // Up to 32 tokens x 512 features per container
+    vector<Ctxt> containers = controller.generate_containers(output, nullptr);
+
+    int inner = controller.nested_threads();
+    #pragma omp parallel for schedule(dynamic) num_threads(controller.ciphertext_workers) if(controller.ciphertext_workers > 1)
+    for (size_t i = 0; i < containers.size(); i++) {
+        omp_set_num_threads(inner);
+        containers[i] = ensure_levels(containers[i], chebyshev_depth(calibration.gelu_degree[layer]));
+        containers[i] = controller.eval_gelu_function(containers[i], -1, 1, gelu_scale, calibration.gelu_degree[layer]);
+        containers[i] = controller.bootstrap(containers[i]);
+    }
+
+    vector<vector<Ctxt>> unwrapped_output = controller.unwrapRepeatedLarge(containers, inputs_count);
+    output = controller.matmulCRlarge(unwrapped_output, output_w, output_b);
+
+    Ctxt ffn_output = controller.wrapUpExpanded(output);
+    controller.add_inplace(ffn_output, wrapped_output); // Residual connection
+
+    ffn_output = controller.bootstrap(ffn_output);
+    ffn_output = layernorm(ffn_output, prefix + "output", layer, inputs_count);
+
+    if (verbose) print_duration(start, "Layer " + to_string(layer) + " feed forward");
+
+    return ffn_output;
+}
+
+// LayerNorm with the statistics precomputed on the training set: (x - mean) * vy + normbias.
+// The mean is stored already negated (encrypt_weights, scale -1).
+// With --exact-layernorm mean and variance are computed on the ciphertext (normweight = gamma)
+Ctxt layernorm(const Ctxt &input, const string &prefix, int layer, int inputs_count) {
+    if (exact_layernorm) {
+        Ctxt gamma = controller.load_ciphertext(prefix + "_normweight.txt.enc");
+        Ctxt beta = controller.load_ciphertext(prefix + "_normbias.txt.enc");
+
+        // Variance range of the residual stream before the LayerNorms of this layer (calibrate.py)
+        Ctxt output = controller.layernorm(input, inputs_count, gamma, beta,
+                                           calibration.layernorm_var_min[layer], calibration.layernorm_var_max[layer]);
+
+        // Unwrap + the next dense layer
+        return ensure_levels(output, 3);
+    }
+
+    Ctxt mean = controller.load_ciphertext(prefix + "_mean.txt.enc");
+    Ctxt vy = controller.load_ciphertext(prefix + "_vy.txt.enc");
+    Ctxt normbias = controller.load_ciphertext(prefix + "_normbias.txt.enc");
+
+    Ctxt output = controller.add(input, mean);
+    output = controller.mult(output, vy);
+    controller.add_inplace(output, normbias);
+
+    return output;
+}
+
+// Bootstraps only when the next `levels` levels are not available anymore
+Ctxt ensure_levels(const Ctxt &c, int levels) {
+    if (controller.remaining_levels(c) < levels) {
+        return controller.bootstrap(c);
+    }
+
+    return c;
+}
+
+void report_layer_time(const string &name, chrono::time_point<steady_clock, nanoseconds> start) {
+    double elapsed = duration_cast<milliseconds>(steady_clock::now() - start).count() / 1000.0;
+
+    cout << "The evaluation of " << name << " took: " << elapsed << " seconds." << endl;
+
+    if (layer_budget > 0 && elapsed > layer_budget) {
+        cout << RED_TEXT << "Warning: " << name << " is over the latency budget of " << layer_budget
+             << " seconds" << RESET_COLOR << endl;
+    }
+}
+
+/*
+ * Level plan of the head. The pooler ends with tanh on values in [-1, 1]; the classifier then needs
+ * HEAD_LEVELS levels (weight product, output mask) and the evaluation of the logits head_reserve more
+ * (benchmark_eval / --evaluate: logit mask, sign, match). With --fused-head the pooler bootstrap, the most
+ * expensive step of a sample, is only done when the levels left after tanh do not cover both.
+ */
+const int HEAD_LEVELS = 2;
+
+Ctxt pooler_output(const Ctxt &activated) {
+    if (fused_head) {
+        int reserve = head_reserve >= 0 ? head_reserve : 1 + controller.sign_depth(-calibration.sign_bound, calibration.sign_bound, calibration.sign_degree) + 2;
+        if (controller.remaining_levels(activated) >= HEAD_LEVELS + reserve) return activated;
+    }
+
+    return controller.bootstrap(activated);
+}
+
+// The classifier weights are consumed at the level of the pooler output: encrypted at another level,
+// every product first has to bring them to it
+void check_head_level(const Ctxt &input, const Ctxt &weight) {
+    static bool reported = false;
+    if (!fused_head || reported || weight->GetLevel() == input->GetLevel()) return;
+
+    reported = true;
+    cout << "Classifier weights at level " << weight->GetLevel() << ", pooler output at level " << input->GetLevel()
+         << ": ./encrypt_weights --load --head-level " << input->GetLevel() << " encrypts them at that level" << endl;
+}
+
 Ctxt classifier(Ctxt input) {
     // Load encrypted classifier weights
     Ctxt weight = controller.load_ciphertext("encrypted_weights/classifier_weight.txt.enc");
     Ctxt bias = controller.load_ciphertext("encrypted_weights/classifier_bias.txt.enc");
 
-    Ctxt output = controller.mult(input, weight);
-    output = controller.rotsum(output, 128, 1);
-    output = controller.add(output, bias);
+    check_head_level(input, weight);
+    Ctxt output = controller.dot_product({input}, {weight}, 128, 1, bias);
 
     vector<double> mask;
     for (int i = 0; i < controller.num_slots; i++) {
@@ -85,7 +733,8 @@ Ctxt classifier(Ctxt input) {
     mask[0] = 1;
     mask[128] = 1;
 
-    output = controller.mult(output, controller.encrypt(mask, output->GetLevel()));
+    // Public mask: a plaintext at the level of the product, no encryption and no relinearization
+    output = controller.mult(output, controller.encode(mask, output->GetLevel(), controller.num_slots));
     output = controller.add(output, controller.rotate(controller.rotate(output, -1), 128));
 
     return output;
@@ -93,18 +742,15 @@ Ctxt classifier(Ctxt input) {
 
 Ctxt pooler(Ctxt input) {
     auto start = high_resolution_clock::now();
-    double tanhScale = 1 / 30.0;
+    double tanhScale = calibration.tanh_scale;
 
 
     Ctxt weight_enc = controller.load_ciphertext("encrypted_weights/pooler_dense_weight.txt.enc");
     Ctxt bias_enc = controller.load_ciphertext("encrypted_weights/pooler_dense_bias.txt.enc");
 
-    Ctxt output = controller.mult(input, weight_enc);
-
-    output = controller.rotsum(output, 128, 128);
-    output = controller.add(output, bias_enc);
-    output = controller.eval_tanh_function(output, -1, 1, tanhScale, 200); // 9 depth
-    output = controller.bootstrap(output);
+    Ctxt output = controller.dot_product({input}, {weight_enc}, 128, 128, bias_enc);
+    output = controller.eval_tanh_function(output, -1, 1, tanhScale, calibration.tanh_degree); // 9 depth with 200
+    output = pooler_output(output);
 
     if (verbose) cout << "The evaluation of Pooler took: " << (duration_cast<milliseconds>(high_resolution_clock::now() - start)).count() / 1000.0 << " seconds." << endl;
     if (verbose) controller.print(output, 128, "Pooler (Repeated)");
@@ -112,6 +758,42 @@ Ctxt pooler(Ctxt input) {
     return output;
 }
 
+// Same layers with the diagonal (BSGS) matvec, weights from encrypt_weights --diagonals.
+// Input and output keep the repeated layout (period 128 for the pooler, period 2 for the logits)
+Ctxt classifier_bsgs(Ctxt input) {
+    vector<Ctxt> weight_diagonals = controller.load_vector("encrypted_weights/classifier_weight.txt.diag.enc");
+    Ctxt bias = controller.load_ciphertext("encrypted_weights/classifier_bias.txt.rep2.enc");
+    check_head_level(input, weight_diagonals[0]);
+
+    Ctxt output = controller.matvec_bsgs(input, weight_diagonals, 128, 2);
+    controller.add_inplace(output, bias);
+
+    //Logits are already in slots 0 (NEG) and 1 (POS), no rotations needed
+    vector<double> mask(controller.num_slots, 0);
+    mask[0] = 1;
+    mask[1] = 1;
+
+    return controller.mult(output, controller.encode(mask, output->GetLevel(), controller.num_slots));
+}
+
+Ctxt pooler_bsgs(Ctxt input) {
+    auto start = high_resolution_clock::now();
+    double tanhScale = calibration.tanh_scale;
+
+    vector<Ctxt> weight_diagonals = controller.load_vector("encrypted_weights/pooler_dense_weight.txt.diag.enc");
+    Ctxt bias_enc = controller.load_ciphertext("encrypted_weights/pooler_dense_bias.txt.enc");
+
+    Ctxt output = controller.matvec_bsgs(input, weight_diagonals, 128, 128);
+    controller.add_inplace(output, bias_enc);
+    output = controller.eval_tanh_function(output, -1, 1, tanhScale, calibration.tanh_degree);
+    output = pooler_output(output);
+
+    if (verbose) cout << "The evaluation of Pooler (BSGS) took: " << (duration_cast<milliseconds>(high_resolution_clock::now() - start)).count() / 1000.0 << " seconds." << endl;
+    if (verbose) controller.print(output, 128, "Pooler (Repeated)");
+
+    return output;
+}
+
 void setup_environment(int argc, char *argv[]) {
     string command;
 
@@ -119,20 +801,58 @@ void setup_environment(int argc, char *argv[]) {
     //     demo = true;
     //     return;
     // }
-    if (argc < 3) {
-        cout << "Usage: ./client_inference <input_folder> <result_folder> [OPTIONS]\n\n";
+    bool stream_mode = argc >= 2 && string(argv[1]) == "--stream";
+
+    if (argc < 3 && !stream_mode) {
+        cout << "Usage: ./client_inference <input_folder> <result_folder> [OPTIONS]\n";
+        cout << "       ./client_inference --stream [<pipe>] [OPTIONS]\n\n";
         cout << "Options:\n";
         cout << "  --verbose: Print detailed information, need private key\n";
         cout << "  --plain: Compare with plain circuit\n\n";
         cout << "  --demo: continue with inference 'It's a good film'\n\n";
+        cout << "  --bsgs: Pooler/Classifier with the diagonal BSGS matvec (needs encrypt_weights --diagonals)\n\n";
+        cout << "  --encoder: Run the two encoder layers encrypted too (needs encrypt_weights --encoder),\n";
+        cout << "             <input_folder>/<input_folder>_i/input_<token>.txt are the token embeddings;\n";
+        cout << "             with --plain the decrypted [CLS] is compared with <input_folder>_i/reference.txt\n";
+        cout << "  --layer-budget <seconds>: Warn when an encoder layer takes longer\n";
+        cout << "  --exact-layernorm: Encoder LayerNorm with encrypted mean/variance instead of the precomputed ones\n";
+        cout << "  --prefetch <n>: Samples encrypted ahead of the evaluation (default 2)\n";
+        cout << "  --range <first> <count>: Only samples first..first+count-1 (shards of the coordinator)\n";
+        cout << "  --fork-workers <n>: Load the keys once, then fork n workers that share them (copy-on-write)\n";
+        cout << "  --encoder-workers <n>: Encoder tokens/containers evaluated by n threads (default 4, 1 = sequential),\n";
+        cout << "             the per-layer timings show the mode\n";
+        cout << "  --zero-pool <n>: Keep n public-key encryptions of zero ready in the background,\n";
+        cout << "             an input is then encrypted with an encode + add (one zero per token with --encoder)\n";
+        cout << "  --fused-head: Skip the pooler bootstrap when the levels left after tanh cover the classifier\n";
+        cout << "             and the evaluation of the logits (see --head-reserve, encrypt_weights --head-level)\n";
+        cout << "  --head-reserve <levels>: Levels kept for the logits by --fused-head (default: benchmark_eval's)\n";
+        cout << "  --raw-results: Write res_i in the raw ciphertext format instead of cereal (faster to write and\n";
+        cout << "             load; benchmark_eval reads both, other OpenFHE programs only cereal)\n";
+        cout << "  --odd-tanh: Pooler tanh as x * g(x^2) (half the Chebyshev basis, one more level)\n";
+        cout << "  --odd-sign: Same for the Chebyshev sign of --evaluate (pass it to benchmark_eval too)\n";
+        cout << "  --calibration <file>: Activation scales and degrees, softmax/LayerNorm ranges, sign interval from calibrate.py\n";
+        cout << "             (the file encrypt_weights --calibration encrypted the weights with)\n";
+        cout << "  --evaluate <labels_file> <result_name>: Accumulate the logits in this process and write the\n";
+        cout << "             encrypted accuracy (+ .partial) like benchmark_eval, instead of the res_i files\n";
+        cout << "  --cache <dir>: Keep pooled/classified ciphertexts keyed by input, weights and flags;\n";
+        cout << "             a rerun skips the samples (or stages) already computed\n";
+        cout << "  --stream [<pipe>]: Read records from stdin (or a named pipe) instead of <input_folder>:\n";
+        cout << "             uint32 count + count float64 (128 per token with --encoder), until EOF.\n";
+        cout << "             Results go to stdout as uint32 index + uint64 size + serialized ciphertext,\n";
+        cout << "             logs go to stderr\n\n";
         cout << "Example:\n";
         cout << "  ./client_inference \"I think this movie is great!\" --verbose\n";
         // TODO: upd example in usage cout
         // TODO: upd options based on usage
         exit(0);
     } else {
-        input_folder = argv[1];
-        output_folder = argv[2];
+        if (stream_mode) {
+            stream = true;
+            if (argc >= 3 && string(argv[2]).rfind("--", 0) != 0) stream_source = argv[2];
+        } else {
+            input_folder = argv[1];
+            output_folder = argv[2];
+        }
 
         for (int i = 2; i < argc; i++) {
             if (string(argv[i]) == "--verbose") {
@@ -141,6 +861,77 @@ void setup_environment(int argc, char *argv[]) {
             if (string(argv[i]) == "--plain") {
                 plain = true;
             }
+            if (string(argv[i]) == "--bsgs") {
+                bsgs = true;
+            }
+            if (string(argv[i]) == "--encoder") {
+                encoder = true;
+            }
+            if (string(argv[i]) == "--exact-layernorm") {
+                exact_layernorm = true;
+            }
+            if (string(argv[i]) == "--range" && i + 2 < argc) {
+                range_first = stoi(argv[++i]);
+                range_count = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--fork-workers" && i + 1 < argc) {
+                fork_workers = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--encoder-workers" && i + 1 < argc) {
+                encoder_workers = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--calibration" && i + 1 < argc) {
+                calibration = Calibration::load(argv[++i]);
+            }
+            if (string(argv[i]) == "--fused-head") {
+                fused_head = true;
+            }
+            if (string(argv[i]) == "--raw-results") {
+                raw_results = true;
+            }
+            if (string(argv[i]) == "--head-reserve" && i + 1 < argc) {
+                head_reserve = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--odd-tanh") {
+                controller.tanh_odd = true;
+            }
+            if (string(argv[i]) == "--odd-sign") {
+                controller.sign_odd = true;
+            }
+            if (string(argv[i]) == "--evaluate" && i + 2 < argc) {
+                evaluate_labels = argv[++i];
+                evaluate_result = argv[++i];
+            }
+            if (string(argv[i]) == "--zero-pool" && i + 1 < argc) {
+                zero_pool = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--cache" && i + 1 < argc) {
+                cache_folder = argv[++i];
+            }
+            if (string(argv[i]) == "--prefetch" && i + 1 < argc) {
+                prefetch = stoi(argv[++i]);
+            }
+            if (string(argv[i]) == "--layer-budget" && i + 1 < argc) {
+                layer_budget = stod(argv[++i]);
+            }
+        }
+
+        // The encoder returns the [CLS] token expanded, the BSGS pooler expects it repeated
+        if (encoder && bsgs) {
+            cerr << "--encoder can not be combined with --bsgs" << endl;
+            exit(1);
+        }
+
+        // Every worker would hold only part of the accumulators: use --range per process and benchmark_eval --merge
+        if (!evaluate_labels.empty() && fork_workers > 1) {
+            cerr << "--evaluate can not be combined with --fork-workers" << endl;
+            exit(1);
+        }
+
+        // A single stdin can not be split between processes
+        if (stream && fork_workers > 1) {
+            cerr << "--fork-workers can not be combined with --stream" << endl;
+            exit(1);
         }
     }
 }
@@ -0,0 +1,280 @@
+//
+// Sharded batch inference: splits <input_folder> into shards and runs one client_inference_batch
+// (--range) per shard, on this host or on other hosts through ssh. Failed shards are retried,
+// the results are the usual <result_folder>/res_i.txt.enc for benchmark_eval.
+//
+
+#include <iostream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+void setup_environment(int argc, char *argv[]);
+
+string input_folder;
+string result_folder;
+string binary = "./client_inference_batch";
+string log_folder = "shard_logs";
+int workers = 2;
+int shard_size = 0;   // 0 = number of samples / (4 * workers), at least 1
+int retries = 2;
+bool encoder = false;
+vector<string> hosts;        // --hosts: ssh targets, empty = local processes
+vector<string> worker_args;  // everything after "--", passed to every worker
+
+struct Shard {
+    int first;
+    int count;
+    int attempts = 0;
+};
+
+// Starts a worker process, stdout/stderr go to the log file. Returns the pid, -1 on failure
+class Transport {
+public:
+    virtual ~Transport() = default;
+    virtual pid_t launch(const vector<string> &args, const string &log_file) = 0;
+    virtual string name() const = 0;
+};
+
+class LocalTransport : public Transport {
+public:
+    pid_t launch(const vector<string> &args, const string &log_file) override {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+        vector<char *> argv;
+        for (const string &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int status = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        return status == 0 ? pid : -1;
+    }
+
+    string name() const override { return "local"; }
+};
+
+// Same command on a remote host. Assumes the working directory (keys, weights, inputs, results)
+// is shared at the same path, e.g. over NFS
+class SshTransport : public Transport {
+public:
+    explicit SshTransport(const string &host) : host(host) {}
+
+    pid_t launch(const vector<string> &args, const string &log_file) override {
+        string command = "cd '" + fs::current_path().string() + "' &&";
+        for (const string &arg : args) command += " '" + arg + "'";
+
+        return local.launch({"ssh", "-o", "BatchMode=yes", host, command}, log_file);
+    }
+
+    string name() const override { return host; }
+
+private:
+    string host;
+    LocalTransport local;
+};
+
+int count_samples() {
+    int count = 0;
+    while (true) {
+        string sample = input_folder + "/" + input_folder + "_" + to_string(count);
+        // plain or seeded upload (.txt.enc)
+        bool found = encoder ? fs::is_directory(sample)
+                             : fs::is_regular_file(sample + ".txt") || fs::is_regular_file(sample + ".txt.enc");
+        if (!found) break;
+        count++;
+    }
+    return count;
+}
+
+// The workers write res_i.txt.enc.tmp and rename it: an existing res_i is always a complete file
+bool shard_complete(const Shard &shard) {
+    for (int i = shard.first; i < shard.first + shard.count; i++) {
+        if (!fs::exists(result_folder + "/res_" + to_string(i) + ".txt.enc")) return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    setup_environment(argc, argv);
+
+    int n = count_samples();
+    if (n == 0) {
+        cerr << "No samples found in \"" << input_folder << "\"" << endl;
+        exit(1);
+    }
+
+    if (shard_size <= 0) shard_size = max(1, n / (4 * workers));
+
+    deque<Shard> pending;
+    for (int first = 0; first < n; first += shard_size) {
+        pending.push_back({first, min(shard_size, n - first)});
+    }
+    int shards_count = pending.size();
+
+    fs::create_directories(result_folder);
+    fs::create_directories(log_folder);
+
+    // One slot per worker, round-robin over the hosts
+    vector<unique_ptr<Transport>> transports;
+    for (int w = 0; w < workers; w++) {
+        if (hosts.empty()) transports.push_back(make_unique<LocalTransport>());
+        else transports.push_back(make_unique<SshTransport>(hosts[w % hosts.size()]));
+    }
+
+    cout << n << " samples, " << shards_count << " shards of " << shard_size << ", " << workers << " workers" << endl;
+
+    auto start = steady_clock::now();
+    map<pid_t, pair<int, Shard>> running; // pid -> (worker slot, shard)
+    vector<bool> busy(workers, false);
+    int done = 0;
+    int failed = 0;
+
+    while (!pending.empty() || !running.empty()) {
+        for (int w = 0; w < workers && !pending.empty(); w++) {
+            if (busy[w]) continue;
+
+            Shard shard = pending.front();
+            pending.pop_front();
+            shard.attempts++;
+
+            vector<string> args = {binary, input_folder, result_folder,
+                                   "--range", to_string(shard.first), to_string(shard.count)};
+            args.insert(args.end(), worker_args.begin(), worker_args.end());
+
+            string log_file = log_folder + "/shard_" + to_string(shard.first) + ".log";
+            pid_t pid = transports[w]->launch(args, log_file);
+            if (pid < 0) {
+                cerr << "Cannot start a worker on " << transports[w]->name() << endl;
+                exit(1);
+            }
+
+            cout << "Shard " << shard.first << ".." << shard.first + shard.count - 1 << " -> "
+                 << transports[w]->name() << " (attempt " << shard.attempts << ")" << endl;
+            running[pid] = {w, shard};
+            busy[w] = true;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) break;
+
+        auto it = running.find(pid);
+        if (it == running.end()) continue;
+
+        int w = it->second.first;
+        Shard shard = it->second.second;
+        running.erase(it);
+        busy[w] = false;
+
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && shard_complete(shard);
+        if (ok) {
+            done++;
+            double elapsed = duration_cast<milliseconds>(steady_clock::now() - start).count() / 1000.0;
+            cout << "[" << done << "/" << shards_count << "] Shard " << shard.first << " done, "
+                 << elapsed << " s elapsed" << endl;
+        } else if (shard.attempts <= retries) {
+            cerr << "Shard " << shard.first << " failed on " << transports[w]->name() << ", retrying (see "
+                 << log_folder << "/shard_" << shard.first << ".log)" << endl;
+            pending.push_back(shard);
+        } else {
+            cerr << "Shard " << shard.first << " failed " << shard.attempts << " times, giving up" << endl;
+            failed++;
+        }
+    }
+
+    // benchmark_eval reads res_0..res_{n-1}: report the holes
+    int missing = 0;
+    for (int i = 0; i < n; i++) {
+        if (!fs::exists(result_folder + "/res_" + to_string(i) + ".txt.enc")) missing++;
+    }
+
+    if (failed > 0 || missing > 0) {
+        cerr << failed << " shards failed, " << missing << " results missing in " << result_folder << endl;
+        return 1;
+    }
+
+    cout << "All " << n << " results in " << result_folder << endl;
+    return 0;
+}
+
+void setup_environment(int argc, char *argv[]) {
+    if (argc < 3) {
+        cout << "Usage: ./coordinator <input_folder> <result_folder> [OPTIONS] [-- <worker options>]\n\n";
+        cout << "Options:\n";
+        cout << "  --workers <n>: Worker processes running at the same time (default 2)\n";
+        cout << "  --shard-size <n>: Samples per shard (default samples / (4 * workers))\n";
+        cout << "  --retries <n>: Attempts after the first failure of a shard (default 2)\n";
+        cout << "  --hosts <h1,h2,...>: Run the workers through ssh on these hosts (shared working directory)\n";
+        cout << "  --binary <path>: Worker executable (default ./client_inference_batch)\n";
+        cout << "  --logs <dir>: Worker logs (default shard_logs)\n";
+        cout << "  --encoder: Samples are token folders, also passed to the workers\n\n";
+        cout << "Example:\n";
+        cout << "  ./coordinator hs results --workers 4 -- --bsgs\n";
+        exit(0);
+    }
+
+    input_folder = argv[1];
+    result_folder = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--") {
+            worker_args.insert(worker_args.end(), argv + i + 1, argv + argc);
+            break;
+        }
+        if (arg == "--workers" && i + 1 < argc) {
+            workers = stoi(argv[++i]);
+        }
+        if (arg == "--shard-size" && i + 1 < argc) {
+            shard_size = stoi(argv[++i]);
+        }
+        if (arg == "--retries" && i + 1 < argc) {
+            retries = stoi(argv[++i]);
+        }
+        if (arg == "--binary" && i + 1 < argc) {
+            binary = argv[++i];
+        }
+        if (arg == "--logs" && i + 1 < argc) {
+            log_folder = argv[++i];
+        }
+        if (arg == "--encoder") {
+            encoder = true;
+            worker_args.push_back("--encoder");
+        }
+        if (arg == "--hosts" && i + 1 < argc) {
+            string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t end = list.find(',', start);
+                if (end == string::npos) end = list.size();
+                if (end > start) hosts.push_back(list.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+    }
+
+    if (workers < 1) {
+        cerr << "--workers must be at least 1" << endl;
+        exit(1);
+    }
+}
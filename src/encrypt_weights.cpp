@@ -1,4 +1,5 @@
 #include "FHEController.h"
+#include "Calibration.h"
 #include <iostream>
 #include <vector>
 #include <string>
@@ -13,10 +14,34 @@ struct WeightSpec {
     string path;
     string func;
     vector<string> args; // аргументы кроме path
+    string name = "";    // имя .enc файла, если отличается от имени path
+};
+
+// Диагонали матрицы d_out x d_in для matvec_bsgs
+struct DiagonalSpec {
+    string path;
+    int d_in;
+    int d_out;
+    int level;
+    string scale;
+    bool transposed; // файл хранит W^T (по строке на входной признак)
 };
 
 
 int verbose = 1;
+// Level of the classifier weights: where client_inference_batch consumes them (10 = after the pooler
+// bootstrap). --head-level sets it for --fused-head, which prints the level it measures
+int head_level = 10;
+// Scales of the tanh / GELU inputs, folded into the weights (--calibration, calibrate.py)
+Calibration calibration;
+// --raw: weights in the raw ciphertext format (save_raw), load_ciphertext/load_vector read both
+bool raw_weights = false;
+
+template <typename T>
+void save_encrypted(const T &c, const string &filename) {
+    if (raw_weights) controller.save_raw(c, filename);
+    else controller.save(c, filename);
+}
 
 double parse_arg(const string& s) {
     if (s.find('/') != string::npos) {
@@ -54,6 +79,7 @@ Ptxt call_read_func(const WeightSpec& spec) {
         if (spec.args.size() == 0) return controller.read_plain_repeated_input(spec.path);
         if (spec.args.size() == 1) return controller.read_plain_repeated_input(spec.path, parse_arg(spec.args[0]));
         if (spec.args.size() == 2) return controller.read_plain_repeated_input(spec.path, parse_arg(spec.args[0]), parse_arg(spec.args[1]));
+        if (spec.args.size() == 3) return controller.read_plain_repeated_input(spec.path, parse_arg(spec.args[0]), parse_arg(spec.args[1]), parse_arg(spec.args[2]));
     }
     else if (spec.func == "read_plain_expanded_input") {
         if (spec.args.size() == 0) return controller.read_plain_expanded_input(spec.path);
@@ -67,78 +93,173 @@ Ptxt call_read_func(const WeightSpec& spec) {
 
 vector<WeightSpec> get_all_ptxt_specs() {
     return {
-        // // ───── Layer 0 (encoder1, level = 8) ─────
-        // {"../weights-sst2/layer0_attself_query_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_attself_query_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer0_attself_key_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_attself_key_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer0_attself_value_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_attself_value_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer0_selfoutput_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_selfoutput_bias.txt", "read_plain_expanded_input", {"8"}},
-        // {"../weights-sst2/layer0_selfoutput_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
-        // {"../weights-sst2/layer0_selfoutput_vy.txt", "read_plain_input", {"8", "1"}},
-        // {"../weights-sst2/layer0_selfoutput_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
-        // {"../weights-sst2/layer0_intermediate_weight1.txt", "read_plain_input", {"8", "1/13.5"}},
-        // {"../weights-sst2/layer0_intermediate_weight2.txt", "read_plain_input", {"8", "1/13.5"}},
-        // {"../weights-sst2/layer0_intermediate_weight3.txt", "read_plain_input", {"8", "1/13.5"}},
-        // {"../weights-sst2/layer0_intermediate_weight4.txt", "read_plain_input", {"8", "1/13.5"}},
-        // {"../weights-sst2/layer0_intermediate_bias.txt", "read_plain_input", {"8", "1/13.5"}},
-        // {"../weights-sst2/layer0_output_weight1.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_output_weight2.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_output_weight3.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_output_weight4.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer0_output_bias.txt", "read_plain_expanded_input", {"8"}},
-        // {"../weights-sst2/layer0_output_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
-        // {"../weights-sst2/layer0_output_vy.txt", "read_plain_input", {"8", "1"}},
-        // {"../weights-sst2/layer0_output_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
-
-        // // ───── Layer 1 (encoder2, level = 8) ─────
-        // {"../weights-sst2/layer1_attself_query_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_attself_query_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer1_attself_key_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_attself_key_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer1_attself_value_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_attself_value_bias.txt", "read_plain_repeated_input", {"8"}},
-        // {"../weights-sst2/layer1_selfoutput_weight.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_selfoutput_bias.txt", "read_plain_expanded_input", {"8"}},
-        // {"../weights-sst2/layer1_selfoutput_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
-        // {"../weights-sst2/layer1_selfoutput_vy.txt", "read_plain_input", {"8", "1"}},
-        // {"../weights-sst2/layer1_selfoutput_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
-        // {"../weights-sst2/layer1_intermediate_weight1.txt", "read_plain_input", {"8", "1/17.0"}},
-        // {"../weights-sst2/layer1_intermediate_weight2.txt", "read_plain_input", {"8", "1/17.0"}},
-        // {"../weights-sst2/layer1_intermediate_weight3.txt", "read_plain_input", {"8", "1/17.0"}},
-        // {"../weights-sst2/layer1_intermediate_weight4.txt", "read_plain_input", {"8", "1/17.0"}},
-        // {"../weights-sst2/layer1_intermediate_bias.txt", "read_plain_input", {"8", "1/17.0"}},
-        // {"../weights-sst2/layer1_output_weight1.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_output_weight2.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_output_weight3.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_output_weight4.txt", "read_plain_input", {"8"}},
-        // {"../weights-sst2/layer1_output_bias.txt", "read_plain_expanded_input", {"8"}},
-        // {"../weights-sst2/layer1_output_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
-        // {"../weights-sst2/layer1_output_vy.txt", "read_plain_input", {"8", "1"}},
-        // {"../weights-sst2/layer1_output_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
-
         // ───── Pooler ─────
         // {"weights-sst2/pooler_dense_weight.txt", "read_plain_input", {"0", "1/25.0"}},
         // {"weights-sst2/pooler_dense_bias.txt", "read_plain_repeated_input", {"0", "1/25.0"}},
-        {"weights-sst2/pooler_dense_weight.txt", "read_plain_input", {"0", "1/30.0"}},
-        {"weights-sst2/pooler_dense_bias.txt", "read_plain_repeated_input", {"1", "1/30.0"}},
+        {"weights-sst2/pooler_dense_weight.txt", "read_plain_input", {"0", Calibration::format(calibration.tanh_scale)}},
+        {"weights-sst2/pooler_dense_bias.txt", "read_plain_repeated_input", {"1", Calibration::format(calibration.tanh_scale)}},
 
         // ───── Classifier ─────
-        {"weights-sst2/classifier_weight.txt", "read_plain_input", {"10"}},
-        {"weights-sst2/classifier_bias.txt", "read_plain_expanded_input", {"10"}}
+        {"weights-sst2/classifier_weight.txt", "read_plain_input", {to_string(head_level)}},
+        {"weights-sst2/classifier_bias.txt", "read_plain_expanded_input", {to_string(head_level)}}
     };
 }
 
-int main(int argc, char *argv[]) {
-    cout << "\n[🔐] Encrypting all Ptxt weights from weights-sst2/ → encrypted_weights/\n";
+// Веса encoder1/encoder2 для client_inference_batch --encoder
+vector<WeightSpec> get_all_encoder_specs() {
+    string gelu0 = Calibration::format(calibration.gelu_scale[0]);
+    string gelu1 = Calibration::format(calibration.gelu_scale[1]);
+
+    return {
+        // ───── Layer 0 (encoder1, level = 8) ─────
+        {"weights-sst2/layer0_attself_query_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_attself_query_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer0_attself_key_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_attself_key_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer0_attself_value_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_attself_value_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer0_selfoutput_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_selfoutput_bias.txt", "read_plain_expanded_input", {"8"}},
+        {"weights-sst2/layer0_selfoutput_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
+        {"weights-sst2/layer0_selfoutput_vy.txt", "read_plain_input", {"8", "1"}},
+        {"weights-sst2/layer0_selfoutput_normweight.txt", "read_plain_expanded_input", {"8", "1"}}, // gamma, --exact-layernorm
+        {"weights-sst2/layer0_selfoutput_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
+        {"weights-sst2/layer0_intermediate_weight1.txt", "read_plain_input", {"8", gelu0}},
+        {"weights-sst2/layer0_intermediate_weight2.txt", "read_plain_input", {"8", gelu0}},
+        {"weights-sst2/layer0_intermediate_weight3.txt", "read_plain_input", {"8", gelu0}},
+        {"weights-sst2/layer0_intermediate_weight4.txt", "read_plain_input", {"8", gelu0}},
+        {"weights-sst2/layer0_intermediate_bias.txt", "read_plain_input", {"8", gelu0}},
+        {"weights-sst2/layer0_output_weight1.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_output_weight2.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_output_weight3.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_output_weight4.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer0_output_bias.txt", "read_plain_expanded_input", {"8"}},
+        {"weights-sst2/layer0_output_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
+        {"weights-sst2/layer0_output_vy.txt", "read_plain_input", {"8", "1"}},
+        {"weights-sst2/layer0_output_normweight.txt", "read_plain_expanded_input", {"8", "1"}}, // gamma, --exact-layernorm
+        {"weights-sst2/layer0_output_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
+
+        // ───── Layer 1 (encoder2, level = 8) ─────
+        {"weights-sst2/layer1_attself_query_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_attself_query_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer1_attself_key_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_attself_key_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer1_attself_value_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_attself_value_bias.txt", "read_plain_repeated_input", {"8"}},
+        {"weights-sst2/layer1_selfoutput_weight.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_selfoutput_bias.txt", "read_plain_expanded_input", {"8"}},
+        {"weights-sst2/layer1_selfoutput_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
+        {"weights-sst2/layer1_selfoutput_vy.txt", "read_plain_input", {"8", "1"}},
+        {"weights-sst2/layer1_selfoutput_normweight.txt", "read_plain_expanded_input", {"8", "1"}}, // gamma, --exact-layernorm
+        {"weights-sst2/layer1_selfoutput_normbias.txt", "read_plain_expanded_input", {"8", "1"}},
+        {"weights-sst2/layer1_intermediate_weight1.txt", "read_plain_input", {"8", gelu1}},
+        {"weights-sst2/layer1_intermediate_weight2.txt", "read_plain_input", {"8", gelu1}},
+        {"weights-sst2/layer1_intermediate_weight3.txt", "read_plain_input", {"8", gelu1}},
+        {"weights-sst2/layer1_intermediate_weight4.txt", "read_plain_input", {"8", gelu1}},
+        {"weights-sst2/layer1_intermediate_bias.txt", "read_plain_input", {"8", gelu1}},
+        {"weights-sst2/layer1_output_weight1.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_output_weight2.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_output_weight3.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_output_weight4.txt", "read_plain_input", {"8"}},
+        {"weights-sst2/layer1_output_bias.txt", "read_plain_expanded_input", {"8"}},
+        {"weights-sst2/layer1_output_mean.txt", "read_plain_repeated_input", {"8", "-1"}},
+        {"weights-sst2/layer1_output_vy.txt", "read_plain_input", {"8", "1"}},
+        {"weights-sst2/layer1_output_normweight.txt", "read_plain_expanded_input", {"8", "1"}}, // gamma, --exact-layernorm
+        {"weights-sst2/layer1_output_normbias.txt", "read_plain_expanded_input", {"8", "1"}}
+    };
+}
+
+// Веса для --diagonals (BSGS matvec в client_inference_batch --bsgs)
+vector<DiagonalSpec> get_all_diagonal_specs() {
+    return {
+        {"weights-sst2/pooler_dense_weight.txt", 128, 128, 0, Calibration::format(calibration.tanh_scale), true},
+        {"weights-sst2/classifier_weight.txt", 128, 2, head_level, "1", false}
+    };
+}
+
+vector<WeightSpec> get_all_diagonal_bias_specs() {
+    return {
+        // логиты после BSGS повторяются с периодом 2
+        {"weights-sst2/classifier_bias.txt", "read_plain_repeated_input", {to_string(head_level), "1", "2"}, "classifier_bias.txt.rep2.enc"}
+    };
+}
+
+// Data owner: <folder>/<folder>_i.txt (or <folder>_i/input_t.txt with --encoder) → same path + ".enc",
+// seeded secret-key ciphertexts, about half the size of a public-key encryption
+void encrypt_inputs_seeded(const string &folder, bool encoder) {
+    int samples = 0;
+    for (int i = 0;; i++, samples++) {
+        string sample = folder + "/" + folder + "_" + to_string(i);
+        vector<string> files;
+        if (!encoder) {
+            if (!fs::is_regular_file(sample + ".txt")) break;
+            files.push_back(sample + ".txt");
+        } else {
+            if (!fs::is_directory(sample)) break;
+            for (int t = 0; fs::is_regular_file(sample + "/input_" + to_string(t) + ".txt"); t++) {
+                files.push_back(sample + "/input_" + to_string(t) + ".txt");
+            }
+        }
 
+        cout << "→ Encrypting " << sample << " (" << files.size() << " inputs) ..." << endl;
+        for (const string &file : files) {
+            Ptxt p = encoder ? controller.read_plain_expanded_input(file) : controller.read_plain_repeated_input(file);
+            controller.save_seeded(controller.encrypt_ptxt_seeded(p), file + ".enc");
+        }
+    }
+
+    if (samples == 0) {
+        cerr << "No samples found in \"" << folder << "\"" << endl;
+        exit(1);
+    }
+    cout << samples << " samples encrypted in " << folder << endl;
+}
+
+int main(int argc, char *argv[]) {
     bool load_weights = false;
+    bool diagonals = false;
+    bool encoder = false;
+    string seeded_inputs;
     for (int i = 1; i < argc; i++) {
         if (string(argv[i]) == "--load") {
             load_weights = true;
         }
+        if (string(argv[i]) == "--diagonals") {
+            diagonals = true;
+        }
+        if (string(argv[i]) == "--encoder") {
+            encoder = true;
+        }
+        if (string(argv[i]) == "--scheme-switching") {
+            // CKKS <-> FHEW keys for benchmark_eval --sign=schemeswitch
+            controller.scheme_switching = true;
+        }
+        if (string(argv[i]) == "--calibration" && i + 1 < argc) {
+            calibration = Calibration::load(argv[++i]);
+        }
+        if (string(argv[i]) == "--head-level" && i + 1 < argc) {
+            head_level = stoi(argv[++i]);
+        }
+        if (string(argv[i]) == "--raw") {
+            raw_weights = true;
+        }
+        if (string(argv[i]) == "--seeded-inputs" && i + 1 < argc) {
+            seeded_inputs = argv[++i];
+        }
+    }
+
+    if (!seeded_inputs.empty()) {
+        // Only the context and the secret key: no weights, no evaluation keys
+        controller.load_context(true);
+        encrypt_inputs_seeded(seeded_inputs, encoder);
+        return 0;
+    }
+
+    cout << "\n[🔐] Encrypting all Ptxt weights from weights-sst2/ → encrypted_weights/\n";
+
+    if (load_weights && controller.scheme_switching) {
+        cerr << "--scheme-switching needs a new context, it cannot be combined with --load" << endl;
+        exit(1);
     }
 
     if (load_weights) {
@@ -157,7 +278,20 @@ int main(int argc, char *argv[]) {
             1, 2, 3, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
             -1, -2, -3, -4, -8, -16, -32, -64, -256, -512
         };
+        // BSGS matvec: 128x128 (pooler), 128->2 (classifier), 128<->512 (intermediate/output)
+        for (auto shape : vector<pair<int, int>>{{128, 128}, {128, 2}, {128, 512}, {512, 128}}) {
+            for (int index : FHEController::bsgs_rotation_indices(shape.first, shape.second)) {
+                if (find(rotations.begin(), rotations.end(), index) == rotations.end()) {
+                    rotations.push_back(index);
+                }
+            }
+        }
         controller.generate_bootstrapping_and_rotation_keys(rotations, 16384, true, "rotation_keys.txt");
+
+        if (controller.scheme_switching) {
+            // After the rotation keys: the scheme switching automorphism keys get their own file
+            controller.generate_scheme_switching_keys(true);
+        }
     }
     // Step 3: Encrypt weights
     cout << "[3/4] Encrypting model weights from weights-sst2/..." << endl;
@@ -169,7 +303,41 @@ int main(int argc, char *argv[]) {
         Ctxt c = controller.encrypt_ptxt(p);
 
         string out = "encrypted_weights/" + fs::path(spec.path).filename().string() + ".enc";
-        controller.save(c, out);
+        save_encrypted(c, out);
+    }
+
+    if (encoder) {
+        cout << "[3/4] Encrypting encoder layers..." << endl;
+        for (auto& spec : get_all_encoder_specs()) {
+            cout << "→ Encrypting " << fs::path(spec.path).filename() << " ..." << endl;
+
+            Ctxt c = controller.encrypt_ptxt(call_read_func(spec));
+            save_encrypted(c, "encrypted_weights/" + fs::path(spec.path).filename().string() + ".enc");
+        }
+    }
+
+    if (diagonals) {
+        cout << "[3/4] Encrypting BSGS diagonals..." << endl;
+        for (auto& spec : get_all_diagonal_specs()) {
+            cout << "→ Encrypting diagonals of " << fs::path(spec.path).filename()
+                 << " (" << spec.d_out << "x" << spec.d_in << ") ..." << endl;
+
+            vector<Ctxt> encrypted_diagonals;
+            for (const Ptxt& p : controller.read_plain_diagonals(spec.path, spec.d_in, spec.d_out, spec.level,
+                                                                 parse_arg(spec.scale), spec.transposed)) {
+                encrypted_diagonals.push_back(controller.encrypt_ptxt(p));
+            }
+
+            string out = "encrypted_weights/" + fs::path(spec.path).filename().string() + ".diag.enc";
+            save_encrypted(encrypted_diagonals, out);
+        }
+
+        for (auto& spec : get_all_diagonal_bias_specs()) {
+            cout << "→ Encrypting " << spec.name << " ..." << endl;
+
+            Ctxt c = controller.encrypt_ptxt(call_read_func(spec));
+            save_encrypted(c, "encrypted_weights/" + spec.name);
+        }
     }
 
     // Step 4: Summary
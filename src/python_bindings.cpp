@@ -0,0 +1,127 @@
+//
+// Python module "fhe_bert": pooler + classifier of client_inference_batch in-process.
+// Keys and encrypted weights are loaded once per Session, hidden states come straight from NumPy.
+// Build with -DBUILD_PYTHON_BINDINGS=ON
+//
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <sstream>
+#include <filesystem>
+#include "FHEController.h"
+#include "Calibration.h"
+
+namespace py = pybind11;
+namespace fs = std::filesystem;
+
+// float64, C-contiguous: such arrays are passed through without a copy, anything else is converted once
+using HiddenStates = py::array_t<double, py::array::c_style | py::array::forcecast>;
+
+class Session {
+public:
+    Session(const string &keys_folder, const string &weights_folder, bool verbose, const string &calibration_file)
+        : verbose(verbose) {
+        // Scales the weights were encrypted with (encrypt_weights --calibration)
+        if (!calibration_file.empty()) calibration = Calibration::load(calibration_file);
+
+        controller.parameters_folder = keys_folder;
+        controller.load_context(verbose);
+        controller.load_bootstrapping_and_rotation_keys("rotation_keys.txt", 16384, verbose);
+
+        pooler_weight = controller.load_ciphertext(weights_folder + "/pooler_dense_weight.txt.enc");
+        pooler_bias = controller.load_ciphertext(weights_folder + "/pooler_dense_bias.txt.enc");
+        classifier_weight = controller.load_ciphertext(weights_folder + "/classifier_weight.txt.enc");
+        classifier_bias = controller.load_ciphertext(weights_folder + "/classifier_bias.txt.enc");
+
+        vector<double> mask(controller.num_slots, 0);
+        mask[0] = 1;
+        mask[128] = 1;
+        classifier_mask = mask;
+    }
+
+    // hidden: the 128 values of the [CLS] hidden state, result: serialized logits ciphertext
+    py::bytes infer(const HiddenStates &hidden) {
+        check_shape(hidden, 1);
+
+        ostringstream out;
+        {
+            py::gil_scoped_release release;
+            Serial::Serialize(evaluate(hidden.data()), out, SerType::BINARY);
+        }
+        return py::bytes(out.str());
+    }
+
+    void infer_to_file(const HiddenStates &hidden, const string &filename) {
+        check_shape(hidden, 1);
+
+        py::gil_scoped_release release;
+        controller.save(evaluate(hidden.data()), filename);
+    }
+
+    // hidden: n x 128, writes <output_folder>/res_<first + i>.txt.enc like client_inference_batch
+    void infer_batch(const HiddenStates &hidden, const string &output_folder, int first) {
+        check_shape(hidden, 2);
+        fs::create_directories(output_folder);
+
+        int n = hidden.shape(0);
+        const double *rows = hidden.data();
+
+        py::gil_scoped_release release;
+        for (int i = 0; i < n; i++) {
+            if (verbose) cout << "[" << i + 1 << "/" << n << "] Running Pooler and Classifier..." << endl;
+            // .tmp + rename, as client_inference_batch: no truncated res_i if the process dies while writing
+            string output_file = output_folder + "/res_" + to_string(first + i) + ".txt.enc";
+            controller.save(evaluate(rows + 128 * i), output_file + ".tmp");
+            fs::rename(output_file + ".tmp", output_file);
+        }
+    }
+
+private:
+    void check_shape(const HiddenStates &hidden, int dimensions) {
+        if (hidden.ndim() != dimensions || hidden.shape(dimensions - 1) != 128) {
+            throw py::value_error(dimensions == 1 ? "expected a hidden state of 128 values"
+                                                  : "expected hidden states of shape (n, 128)");
+        }
+    }
+
+    Ctxt evaluate(const double *hidden) {
+        Ctxt input = controller.encrypt_ptxt(controller.encode_repeated(hidden));
+
+        // Pooler
+        Ctxt output = controller.dot_product({input}, {pooler_weight}, 128, 128, pooler_bias);
+        output = controller.eval_tanh_function(output, -1, 1, calibration.tanh_scale, calibration.tanh_degree);
+        output = controller.bootstrap(output);
+
+        // Classifier
+        output = controller.dot_product({output}, {classifier_weight}, 128, 1, classifier_bias);
+        output = controller.mult(output, controller.encode(classifier_mask, output->GetLevel(), controller.num_slots));
+        output = controller.add(output, controller.rotate(controller.rotate(output, -1), 128));
+
+        return output;
+    }
+
+    FHEController controller;
+    bool verbose;
+    Calibration calibration;
+    Ctxt pooler_weight;
+    Ctxt pooler_bias;
+    Ctxt classifier_weight;
+    Ctxt classifier_bias;
+    vector<double> classifier_mask;
+};
+
+PYBIND11_MODULE(fhe_bert, m) {
+    m.doc() = "Encrypted BERT-Tiny pooler and classifier (OpenFHE CKKS)";
+
+    py::class_<Session>(m, "Session")
+        .def(py::init<const string &, const string &, bool, const string &>(),
+             py::arg("keys_folder") = "keys", py::arg("weights_folder") = "encrypted_weights",
+             py::arg("verbose") = false, py::arg("calibration") = "")
+        .def("infer", &Session::infer, py::arg("hidden"),
+             "Pooler + classifier on one [CLS] hidden state, returns the serialized logits ciphertext")
+        .def("infer_to_file", &Session::infer_to_file, py::arg("hidden"), py::arg("filename"))
+        .def("infer_batch", &Session::infer_batch, py::arg("hidden"), py::arg("output_folder"),
+             py::arg("first") = 0,
+             "Writes res_<first + i>.txt.enc for every row of an (n, 128) array");
+}